@@ -0,0 +1,222 @@
+// Throughput and latency benchmark on synthetic corpora.
+//
+//   sisi_num_conv_bench [-e rd|fsm] [-m convert|extract] [-r rounds] [-n lines] [-c cache_mb]
+//
+// With -m extract, the numerals are located with Extract() instead of
+// rewriting the text, and output_bytes counts the spans found. With -c, the
+// conversions go through a ConversionCache of that many MB, emptied before
+// each round, so the replay corpus, where about 40% of the lines repeat,
+// shows what the cache saves.
+//
+// Prints one JSON document on the standard output, so that results of two
+// versions can be compared by a script.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "chn_num_conv.h"
+#include "chn_num_conv_cache.h"
+
+namespace {
+
+struct Corpus {
+  Corpus(const char* name, sisi::Language lang)
+    : name(name), lang(lang), writer(lang) {
+  }
+
+  // n spelled as numerals of the corpus language, e.g. 1410778724 -> 十四亿一千零七十七万...
+  std::string Spell(int64_t n) const {
+    char buf[sisi::NumeralWriter::kMaxSize];
+    auto [end, ec] = writer.Write(buf, buf + sizeof(buf), n);
+    return std::string(buf, end);
+  }
+
+  const char*              name;
+  sisi::Language           lang;
+  sisi::NumeralWriter      writer;
+  std::vector<std::string> lines;
+  size_t                   bytes = 0;
+  size_t                   codepoints = 0;
+  size_t                   numerals = 0;
+};
+
+void Add(Corpus& c, std::string line, size_t numerals) {
+  c.numerals += numerals;
+  c.lines.push_back(std::move(line));
+}
+
+Corpus MakeNews(size_t lines, std::mt19937_64& rng) {
+  static const char* kText[] = {
+      "据新华社报道，国家统计局发布的数据显示经济运行总体平稳，市场预期持续改善。",
+      "记者从有关部门获悉，<b>相关政策</b>将于下个月正式实施，具体细则另行公布。",
+      "<p class=\"lead\">专家表示，消费市场恢复势头良好，服务业增长较快。</p>",
+  };
+  Corpus c("news_sparse", sisi::Language::Chinese);
+  for (size_t i = 0; i < lines; i++) {
+    std::string line = kText[rng() % 3];
+    line += kText[rng() % 3];
+    line += "其中" + c.Spell(rng() % 10 + 1) + "项指标好于预期。";
+    Add(c, line, 1);
+  }
+  return c;
+}
+
+Corpus MakeFinancial(size_t lines, std::mt19937_64& rng) {
+  Corpus c("financial_dense", sisi::Language::Chinese);
+  for (size_t i = 0; i < lines; i++) {
+    std::string line = "营收" + c.Spell(rng() % 1000000000000) + "元，同比增长百分之" +
+                       c.Spell(rng() % 100) + "，净利润" + c.Spell(rng() % 100000000) +
+                       "元，负债" + c.Spell(-(int64_t)(rng() % 1000000)) + "元";
+    Add(c, line, 4);
+  }
+  return c;
+}
+
+Corpus MakeDigits(size_t lines, std::mt19937_64& rng) {
+  static const char* kDigits[] = { "零", "一", "二", "三", "四", "五", "六", "七", "八", "九" };
+  Corpus c("digit_strings", sisi::Language::Chinese);
+  for (size_t i = 0; i < lines; i++) {
+    std::string line = "电话一三";
+    for (int k = 0; k < 9; k++) {
+      line += kDigits[rng() % 10];
+    }
+    line += "，身份证号";
+    for (int k = 0; k < 18; k++) {
+      line += kDigits[rng() % 10];
+    }
+    Add(c, line, 29);
+  }
+  return c;
+}
+
+Corpus MakeJapanese(size_t lines, std::mt19937_64& rng) {
+  Corpus c("japanese", sisi::Language::Japanese);
+  for (size_t i = 0; i < lines; i++) {
+    int64_t loss = rng() % 1000000000;
+    std::string line = "今期の売上は" + c.Spell(rng() % 100000000000) + "円、欠損金は" +
+                       c.Spell(-loss) + "円です。ゼロからの再建を目指します。";
+    Add(c, line, 3);
+  }
+  return c;
+}
+
+// Replies and menu items from a small set of templates mixed with unique lines,
+// as in a replayed production trace
+Corpus MakeReplay(size_t lines, std::mt19937_64& rng) {
+  Corpus c("replay", sisi::Language::Chinese);
+  std::vector<std::string> templates;
+  for (int i = 0; i < 200; i++) {
+    templates.push_back("您好，您的订单已发货，共" + c.Spell(i % 20 + 1) + "件商品，预计" +
+                        c.Spell(i % 7 + 1) + "天内送达，运费" + c.Spell(i * 37 % 100) + "元。");
+  }
+  for (size_t i = 0; i < lines; i++) {
+    if (rng() % 100 < 40) {
+      Add(c, templates[rng() % templates.size()], 3);
+    } else {
+      Add(c, "订单编号" + std::to_string(i) + "，金额" + c.Spell(rng() % 100000000) + "元，积分" +
+             c.Spell(rng() % 10000) + "分。", 2);
+    }
+  }
+  return c;
+}
+
+void Measure(Corpus& c, sisi::ParserEngine engine, bool extract, int rounds, size_t cache_mb, bool last) {
+  for (auto& line : c.lines) {
+    c.bytes += line.size();
+    for (unsigned char ch : line) {
+      c.codepoints += (ch & 0xc0) != 0x80;
+    }
+  }
+
+  sisi::ChineseNumberConvertor cc(c.lang, engine);
+  sisi::ConversionCache cache(cache_mb << 20);
+  std::vector<double> latency;
+  latency.reserve(c.lines.size() * rounds);
+  size_t sink = 0;
+  auto run = [&](const std::string& line) {
+    if (extract) {
+      return cc.Extract(line).size();
+    }
+    return cache_mb ? cache.Convert(line, cc).view().size() : cc.Convert(line).size();
+  };
+  for (auto& line : c.lines) {
+    sink += run(line);    // warm up
+  }
+  cache.Clear();
+  auto t0 = std::chrono::steady_clock::now();
+  for (int r = 0; r < rounds; r++) {
+    cache.Clear();
+    for (auto& line : c.lines) {
+      auto s = std::chrono::steady_clock::now();
+      sink += run(line);
+      latency.push_back(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - s).count());
+    }
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+  std::sort(latency.begin(), latency.end());
+  auto pct = [&](double p) { return latency[std::min(latency.size() - 1, (size_t)(p * latency.size()))]; };
+
+  printf("    {\"name\": \"%s\", \"language\": \"%s\", \"lines\": %zu, \"bytes\": %zu, "
+         "\"codepoints\": %zu, \"numerals\": %zu, \"rounds\": %d, \"seconds\": %.6f,\n",
+         c.name, c.lang == sisi::Language::Japanese ? "ja" : "zh", c.lines.size(), c.bytes,
+         c.codepoints, c.numerals, rounds, seconds);
+  printf("     \"mb_per_s\": %.2f, \"codepoints_per_s\": %.0f, \"numerals_per_s\": %.0f,\n",
+         c.bytes * rounds / seconds / 1e6, c.codepoints * rounds / seconds, c.numerals * rounds / seconds);
+  printf("     \"latency_ns\": {\"p50\": %.0f, \"p90\": %.0f, \"p99\": %.0f, \"p999\": %.0f, \"max\": %.0f},\n",
+         pct(0.5), pct(0.9), pct(0.99), pct(0.999), latency.back());
+  if (cache_mb) {
+    auto counters = cache.GetCounters();
+    printf("     \"cache_hit_rate\": %.4f, \"cache_evictions\": %llu,\n",
+           double(counters.hits) / (counters.hits + counters.misses), (unsigned long long)counters.evictions);
+  }
+  printf("     \"output_bytes\": %zu}%s\n", sink / (rounds + 1), last ? "" : ",");
+}
+
+}
+
+int main(int argc, char** argv) {
+  sisi::ParserEngine engine = sisi::ParserEngine::RecursiveDescent;
+  bool extract = false;
+  int rounds = 5;
+  size_t lines = 20000;
+  size_t cache_mb = 0;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "-e") == 0) {
+      engine = strcmp(argv[i + 1], "fsm") == 0 ? sisi::ParserEngine::StateMachine
+                                               : sisi::ParserEngine::RecursiveDescent;
+    } else if (strcmp(argv[i], "-m") == 0) {
+      extract = strcmp(argv[i + 1], "extract") == 0;
+    } else if (strcmp(argv[i], "-r") == 0) {
+      rounds = std::max(1, atoi(argv[i + 1]));
+    } else if (strcmp(argv[i], "-n") == 0) {
+      lines = std::max(1, atoi(argv[i + 1]));
+    } else if (strcmp(argv[i], "-c") == 0) {
+      cache_mb = std::max(0, atoi(argv[i + 1]));
+    } else {
+      fprintf(stderr, "usage: %s [-e rd|fsm] [-m convert|extract] [-r rounds] [-n lines] [-c cache_mb]\n",
+              argv[0]);
+      return 2;
+    }
+  }
+
+  std::mt19937_64 rng(20231031);
+  std::vector<Corpus> corpora;
+  corpora.push_back(MakeNews(lines, rng));
+  corpora.push_back(MakeFinancial(lines, rng));
+  corpora.push_back(MakeDigits(lines, rng));
+  corpora.push_back(MakeJapanese(lines, rng));
+  corpora.push_back(MakeReplay(lines, rng));
+
+  printf("{\n  \"engine\": \"%s\",\n  \"mode\": \"%s\",\n  \"corpora\": [\n",
+         engine == sisi::ParserEngine::StateMachine ? "fsm" : "rd", extract ? "extract" : "convert");
+  for (size_t i = 0; i < corpora.size(); i++) {
+    Measure(corpora[i], engine, extract, rounds, cache_mb, i + 1 == corpora.size());
+  }
+  printf("  ]\n}\n");
+}
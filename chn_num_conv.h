@@ -25,9 +25,18 @@ SOFTWARE.
 #define _SISI_CHN_NUM_CONV_H_
 
 #include <vector>
-#include <unordered_map>
 #include <string>
+#include <string_view>
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <variant>
 
 #if SISI_IS_BIG_ENDIAN
 #define SISI_ENABLE_LITTLE_ENDIAN 0
@@ -47,6 +56,32 @@ SOFTWARE.
   #endif
 #endif
 
+#ifndef SISI_ENABLE_SIMD
+  #if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+    #define SISI_ENABLE_SIMD 1
+  #else
+    #define SISI_ENABLE_SIMD 0
+  #endif
+#endif
+#if SISI_ENABLE_SIMD
+#include <immintrin.h>
+#endif
+
+// Map a PhraseLexicon file into memory instead of reading it
+#ifndef SISI_ENABLE_MMAP
+  #if defined(__unix__) || defined(__APPLE__)
+    #define SISI_ENABLE_MMAP 1
+  #else
+    #define SISI_ENABLE_MMAP 0
+  #endif
+#endif
+#if SISI_ENABLE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #define SISI_ENABLE_LOG 0
 #if SISI_ENABLE_LOG
 #define SISI_LOGD(fmt, ...) printf("[%d][%s] " fmt "\n", __LINE__, __FUNCTION__, ## __VA_ARGS__)
@@ -54,26 +89,85 @@ SOFTWARE.
 #define SISI_LOGD(fmt, ...)
 #endif
 
+// Define to 1 to collect ConversionStats. It is off by default and then costs
+// nothing.
+#ifndef SISI_ENABLE_STATS
+#define SISI_ENABLE_STATS 0
+#endif
+#if SISI_ENABLE_STATS
+#include <chrono>
+#define SISI_STAT(stmt) stmt
+#else
+#define SISI_STAT(stmt)
+#endif
+
 /// ^_^ Sisi is my English name Sisi
 namespace sisi {
 
+// A decoding cursor over a borrowed UTF-8 buffer. Characters are decoded on
+// demand when they are first accessed and only the last kWindowSize of them are
+// kept, which is enough for the lookahead and backtracking of the parser.
+// The buffer is not copied and must outlive the cursor.
 class UTF8String {
 public:
-  typedef std::vector<uint32_t> UTF8Sequence;
-  typedef std::vector<int> CharIndexMapping;  // UTF8_index -> CHAR idx mapping
+  enum : size_t {
+    kWindowSize = 32,
+  };
+
+  UTF8String(std::string_view str) {
+    Assign(str);
+  }
 
-  UTF8String(const std::string& str) {
-    this->str_ = str;
+  void Assign(std::string_view str) {
+    str_ = str;
+    decoded_ = 0;
+    offset_ = 0;
   }
 
-  size_t size() {
-    InitString();
-    return seq_.size();
+  // Whether there is a char at index idx
+  bool Has(size_t idx) {
+    Fill(idx);
+    return idx < decoded_;
   }
 
+  // Access a char decoded not more than kWindowSize chars ago
   const uint32_t& operator[] (size_t idx) {
-    InitString();
-    return seq_[idx];
+    Fill(idx);
+    return window_[idx % kWindowSize].ch;
+  }
+
+  // Byte offset of the char at index idx in the buffer
+  size_t ByteOffset(size_t idx) {
+    Fill(idx);
+    return window_[idx % kWindowSize].offset;
+  }
+
+  // Byte offset just past the char at index idx
+  size_t ByteEnd(size_t idx) {
+    Fill(idx);
+    return window_[idx % kWindowSize].offset + window_[idx % kWindowSize].len;
+  }
+
+  // Let the char following index idx be the one at byte offset, skipping
+  // everything in between without decoding it
+  void Skip(size_t idx, size_t offset) {
+    decoded_ = idx + 1;
+    offset_ = offset;
+  }
+
+  std::string_view View() const {
+    return str_;
+  }
+
+  // Byte offset up to which the buffer was decoded, or past its end once the
+  // end was reached
+  size_t Frontier() const {
+    return offset_ < str_.size() ? offset_ : str_.size() + 1;
+  }
+
+  // Size of the buffer in bytes
+  size_t ByteSize() const {
+    return str_.size();
   }
 
   UTF8String& operator=(const UTF8String r) = delete;
@@ -81,27 +175,30 @@ public:
   UTF8String& operator=(const UTF8String&& r) = delete;
 
 private:
-  bool             is_init_ = false;
-  std::string      str_;
-  UTF8Sequence     seq_;
-  CharIndexMapping idx_;
+  struct Char {
+    uint32_t ch;
+    uint32_t len;
+    size_t   offset;
+  };
 
-  void InitString() {
-    if (is_init_) {
-      return;
-    }
-    is_init_ = true;
-    size_t sz = str_.size();
-    int ch_idx = 0;
-    while (ch_idx < sz) {
-      uint32_t ch;
-      idx_.push_back(ch_idx);
-      ch_idx += UTF8NextChar((uint8_t*)str_.c_str() + ch_idx, &ch);
-      seq_.push_back(ch);
+  std::string_view str_;
+  size_t           decoded_;    // number of chars decoded so far
+  size_t           offset_;     // byte offset of the next char to decode
+  Char             window_[kWindowSize];
+
+  void Fill(size_t idx) {
+    while (decoded_ <= idx && offset_ < str_.size()) {
+      Char& c = window_[decoded_ % kWindowSize];
+      c.offset = offset_;
+      c.len = UTF8NextChar((const uint8_t*)str_.data() + offset_, str_.size() - offset_, &c.ch);
+      offset_ += c.len;
+      decoded_++;
     }
   }
 
-  static uint32_t UTF8NextChar(const uint8_t* start, uint32_t* out) {
+  // Decode the char at [start, start + size), size > 0. Only the sequence of
+  // bytes is checked, see UTF8Validator for the rest.
+  static uint32_t UTF8NextChar(const uint8_t* start, size_t size, uint32_t* out) {
 #define SISI_ULS(a, nbits)  (((uint32_t)(a)) << (nbits))
 #if SISI_ENABLE_LITTLE_ENDIAN
 #define SISI_U4(a, b, c, d) (SISI_ULS(a, 0) | SISI_ULS(b, 8) | SISI_ULS(c, 16) | SISI_ULS(d, 24))
@@ -119,26 +216,25 @@ private:
       *out = SISI_U1(b0);
       return 1;
     }
-    uint8_t b1 = *(start + 1);
-    if ((b0 & 0xe0) == 0xc0) {
-      *out = SISI_U2(b0, b1);
-      return 2;
+    uint32_t len = (b0 & 0xe0) == 0xc0 ? 2 : (b0 & 0xf0) == 0xe0 ? 3 : (b0 & 0xf8) == 0xf0 ? 4 : 0;
+    bool valid = len > 0 && len <= size;
+    for (uint32_t i = 1; valid && i < len; i++) {
+      valid = (start[i] & 0xc0) == 0x80;
     }
-    if ((b0 & 0xf0) == 0xe0) {
-      uint8_t b3 = *(start + 2);
-      *out = SISI_U3(b0, b1, b3);
-      return 3;
+    if (!valid) {
+      // A stray byte, or a char cut short by the end of the buffer or by
+      // another char. It reads as U+FFFD and is passed through as is.
+      *out = SISI_U3(0xef, 0xbf, 0xbd);
+      return 1;
     }
-    if ((b0 & 0xf8) == 0xf0) {
-      uint8_t b3 = *(start + 2);
-      uint8_t b4 = *(start + 3);
-      *out = SISI_U4(b0, b1, b3, b4);
-      return 4;
+    if (len == 2) {
+      *out = SISI_U2(b0, start[1]);
+    } else if (len == 3) {
+      *out = SISI_U3(b0, start[1], start[2]);
+    } else {
+      *out = SISI_U4(b0, start[1], start[2], start[3]);
     }
-    // Invalid UTF-8 char
-    fprintf(stderr, "warning: cannot decode UTF-8 char: 0x%x\n", b0);
-    *out = ' ';
-    return 1;
+    return len;
   }
 #undef SISI_ULS
 #undef SISI_U4
@@ -148,437 +244,3369 @@ private:
 };
 
 /*
-   The BNF Grammar is list as follows:
-
-   Negative -> 负 Oku | Oku
-   Oku -> Man 亿 Man | Man
-   Man -> Sen 万 Sen | Sen
-   Sen -> NonZero 千 Hyaku | NonZero 千 零 Juu | Hyaku
-   Hyaku -> NonZero 百 Juu | NonZero 百 零 Num |
-   Juu -> NonZero 十 Num | 十 Num | Num
-   Num -> NonZero | 零
-   NonZero -> 一 | 二 | 三 | 四 | 五 | 六 | 七 | 八 | 九
+   Finds where the next numeral could start, so that the text in between can be
+   copied to the output in one go. Each trigger char is identified by its first
+   two bytes: a byte matches when the nibble tables of the byte and of the byte
+   after it share a bucket bit (the "shufti" technique), 16 or 32 bytes at a
+   time with SSSE3 or AVX2 when the CPU has them. The match is conservative,
+   false positives are simply handled as passthrough by the parser.
  */
-
-enum class Language {
-    Chinese,
-    Japanese
-};
-
-class ChineseNumberConvertor {
+class NumeralScanner {
 public:
-  using U8Char = uint64_t;
-  using U8CharMap = std::unordered_map<U8Char, int>;
-  using NumberType = int64_t;
-
-  enum NumberUnit {
-    NUMBER_UNIT_TEN             = 1,
-    NUMBER_UNIT_HUNDRED         = 2,
-    NUMBER_UNIT_THOUSAND        = 3,
-    NUMBER_UNIT_TEN_THOUSAND    = 4,
-    NUMBER_UNIT_HUNDRED_MILLION = 5,
-
-    NUMBER_UNIT_J               = NUMBER_UNIT_TEN,
-    NUMBER_UNIT_H               = NUMBER_UNIT_HUNDRED,
-    NUMBER_UNIT_S               = NUMBER_UNIT_THOUSAND,
-    NUMBER_UNIT_M               = NUMBER_UNIT_TEN_THOUSAND,
-    NUMBER_UNIT_O               = NUMBER_UNIT_HUNDRED_MILLION,
-  };
-
-  explicit ChineseNumberConvertor(const char* str, Language lang = Language::Chinese) 
-    : str_(str), lang_(lang) {
-    InitializeNumDict();
+  NumeralScanner() {
+    std::fill(lead_lo_, lead_lo_ + 16, 0);
+    std::fill(lead_hi_, lead_hi_ + 16, 0);
+    std::fill(next_lo_, next_lo_ + 16, 0);
+    std::fill(next_hi_, next_hi_ + 16, 0);
+    find_ = &NumeralScanner::FindScalar;
+#if SISI_ENABLE_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      find_ = &NumeralScanner::FindAVX2;
+    } else if (__builtin_cpu_supports("ssse3")) {
+      find_ = &NumeralScanner::FindSSSE3;
+    }
+#endif
   }
 
-  const std::string& Evaluate() {
-    if (!has_out_) return Start();
-    return out_;
+  // Register every char of a UTF-8 string as a trigger
+  void AddChars(const char* str) {
+    const uint8_t* p = (const uint8_t*)str;
+    while (*p) {
+      uint8_t b0 = p[0];
+      if (b0 < 0x80) {
+        // Single byte chars use bucket 0, whatever byte follows them
+        SetBucket(lead_lo_, lead_hi_, b0, 1);
+        std::for_each(next_lo_, next_lo_ + 16, [](uint8_t& m) { m |= 1; });
+        std::for_each(next_hi_, next_hi_ + 16, [](uint8_t& m) { m |= 1; });
+        p += 1;
+        continue;
+      }
+      uint8_t bucket = 1 << (1 + b0 % 7);
+      SetBucket(lead_lo_, lead_hi_, b0, bucket);
+      SetBucket(next_lo_, next_hi_, p[1], bucket);
+      p += (b0 & 0xe0) == 0xc0 ? 2 : (b0 & 0xf0) == 0xe0 ? 3 : 4;
+    }
   }
 
-  const std::string& operator()() {
-    return Evaluate();
+  // Offset of the first byte in [str, str + size) where a trigger may start,
+  // or size if there is none
+  size_t Find(const char* str, size_t size) const {
+    return (this->*find_)((const uint8_t*)str, size);
   }
 
 private:
-  UTF8String  str_;
-  Language    lang_;
-  enum : U8Char {
-    TOKEN_TYPE_EOF = ~((U8Char)0),
-  };
-  U8Char      char_ne_;
-  U8Char      char_pt_;
-  U8Char      char_zero_;
-  U8Char      char_zero_jp_;
-  U8Char      char_ne_jp_alt_;
-  U8CharMap   chn_dict_;
-  std::unordered_map<NumberUnit, U8CharMap> unit_num_;
-  size_t      peak_idx_       = -1;
-  size_t      peak_idx_rec_   = -1;
-  size_t      lookahead_;
-  size_t      unit_factor_    = 1;
-  bool        has_out_        = false;
-  std::string out_;
-  bool        has_error_      = false;
+  uint8_t lead_lo_[16];
+  uint8_t lead_hi_[16];
+  uint8_t next_lo_[16];
+  uint8_t next_hi_[16];
+  size_t (NumeralScanner::*find_)(const uint8_t*, size_t) const;
 
-  U8CharMap MakeCharMapFromString(const char* str) {
-    U8CharMap u8chmap;
-    AssignCharMapFromString(str, u8chmap);
-    return u8chmap;
+  static void SetBucket(uint8_t* lo, uint8_t* hi, uint8_t b, uint8_t bucket) {
+    lo[b & 0xf] |= bucket;
+    hi[b >> 4] |= bucket;
   }
 
-  void AssignCharMapFromString(const char* str, U8CharMap& u8chmap) {
-    UTF8String u8str(str);
-    size_t sz = u8str.size();
-    for (int i=0; i<sz; i++) {
-      u8chmap[u8str[i]] = i;
+  bool Match(const uint8_t* p, size_t size, size_t i) const {
+    uint8_t m = lead_lo_[p[i] & 0xf] & lead_hi_[p[i] >> 4];
+    if (m && i + 1 < size) {
+      m &= next_lo_[p[i + 1] & 0xf] & next_hi_[p[i + 1] >> 4];
     }
+    return m != 0;
   }
 
-  bool In(const U8CharMap& list, int* num) {
-    auto it = list.find(lookahead_);
-    if (it == list.end()) {
-      return false;
-    }
-    if (num) {
-      *num = it->second;
-    }
-    return true;
+  size_t FindScalar(const uint8_t* p, size_t size) const {
+    return FindTail(p, size, 0);
   }
 
-  bool In(const U8CharMap& list) {
-    return In(list, nullptr);
-  }
-  
-  uint32_t GetU8Char(const char* s) {
-      UTF8String u(s);
-      return u[0];
+  size_t FindTail(const uint8_t* p, size_t size, size_t i) const {
+    for (; i < size; i++) {
+      if (Match(p, size, i)) {
+        return i;
+      }
+    }
+    return size;
   }
 
-  void InitializeNumDict() {
-    unit_num_.clear();
-    unit_num_[NUMBER_UNIT_J] = MakeCharMapFromString("十拾");
-    unit_num_[NUMBER_UNIT_H] = MakeCharMapFromString("百佰");
-    unit_num_[NUMBER_UNIT_S] = MakeCharMapFromString("千仟");
-    unit_num_[NUMBER_UNIT_M] = MakeCharMapFromString("万");
-    
-    if (lang_ == Language::Japanese) {
-        unit_num_[NUMBER_UNIT_O] = MakeCharMapFromString("億");
-    } else {
-        unit_num_[NUMBER_UNIT_O] = MakeCharMapFromString("亿");
-    }
-
-    chn_dict_.clear();
-    AssignCharMapFromString("零一二三四五六七八九", chn_dict_);
-    AssignCharMapFromString("零壹贰叁肆伍陆柒捌玖", chn_dict_);
-
-    UTF8String special_words("零点两负負");
-    char_zero_ = special_words[0];
-    char_pt_ = special_words[1];
-    chn_dict_[special_words[2]] = 2; // Alias for 二
-    if (lang_ == Language::Japanese) {
-        char_ne_ = special_words[4]; // 負
-        char_zero_jp_ = 0x200000; // Pseudo token for Ze-Ro
-        char_ne_jp_alt_ = 0x200001; // Pseudo token for Mai-Na-Su
-        chn_dict_[char_zero_jp_] = 0;
-    } else {
-        char_ne_ = special_words[3]; // 负
+#if SISI_ENABLE_SIMD
+  __attribute__((target("ssse3")))
+  size_t FindSSSE3(const uint8_t* p, size_t size) const {
+    const __m128i lead_lo = _mm_loadu_si128((const __m128i*)lead_lo_);
+    const __m128i lead_hi = _mm_loadu_si128((const __m128i*)lead_hi_);
+    const __m128i next_lo = _mm_loadu_si128((const __m128i*)next_lo_);
+    const __m128i next_hi = _mm_loadu_si128((const __m128i*)next_hi_);
+    const __m128i nibble = _mm_set1_epi8(0xf);
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    // The byte after the block is read too, so stop one byte early
+    for (; i + 17 <= size; i += 16) {
+      __m128i b0 = _mm_loadu_si128((const __m128i*)(p + i));
+      __m128i b1 = _mm_loadu_si128((const __m128i*)(p + i + 1));
+      __m128i m0 = _mm_and_si128(
+          _mm_shuffle_epi8(lead_lo, _mm_and_si128(b0, nibble)),
+          _mm_shuffle_epi8(lead_hi, _mm_and_si128(_mm_srli_epi16(b0, 4), nibble)));
+      __m128i m1 = _mm_and_si128(
+          _mm_shuffle_epi8(next_lo, _mm_and_si128(b1, nibble)),
+          _mm_shuffle_epi8(next_hi, _mm_and_si128(_mm_srli_epi16(b1, 4), nibble)));
+      uint32_t miss = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(m0, m1), zero));
+      if (miss != 0xffff) {
+        return i + __builtin_ctz(~miss);
+      }
     }
+    return FindTail(p, size, i);
   }
 
-  U8Char Next() {
-    peak_idx_++;
-    if (peak_idx_ >= str_.size()) {
-      SISI_LOGD("Next EOF. idx=%zu size=%zu", peak_idx_, str_.size());
-      lookahead_ = TOKEN_TYPE_EOF;
-      return lookahead_;
-    }
-    lookahead_ = str_[peak_idx_];
-    SISI_LOGD("Next before JP check: idx=%zu val=%lx", peak_idx_, (uint64_t)lookahead_);
-    
-    if (lang_ == Language::Japanese && peak_idx_ + 1 < str_.size()) {
-         static uint32_t u_ze = GetU8Char("ゼ");
-         static uint32_t u_ro = GetU8Char("ロ");
-         SISI_LOGD("JP Check: Ze=%x Ro=%x Cur=%x +1=%x +2=%x", u_ze, u_ro, (uint32_t)lookahead_, (uint32_t)str_[peak_idx_+1]);
-         
-         if (lookahead_ == u_ze && str_[peak_idx_+1] == u_ro) {
-             peak_idx_ += 1;
-             lookahead_ = char_zero_jp_;
-             SISI_LOGD("Found Ze-Ro. New idx=%zu", peak_idx_);
-         }
-    }
-
-    if (lang_ == Language::Japanese && peak_idx_ + 3 < str_.size()) {
-         static uint32_t u_ma = GetU8Char("マ");
-         static uint32_t u_i = GetU8Char("イ");
-         static uint32_t u_na = GetU8Char("ナ");
-         static uint32_t u_su = GetU8Char("ス");
-         
-         if (lookahead_ == u_ma && str_[peak_idx_+1] == u_i && str_[peak_idx_+2] == u_na && str_[peak_idx_+3] == u_su) {
-             peak_idx_ += 3;
-             lookahead_ = char_ne_jp_alt_;
-             SISI_LOGD("Found Mai-Na-Su. New idx=%zu", peak_idx_);
-         }
-    }
-    
-    return lookahead_;
+  __attribute__((target("avx2")))
+  size_t FindAVX2(const uint8_t* p, size_t size) const {
+    const __m256i lead_lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)lead_lo_));
+    const __m256i lead_hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)lead_hi_));
+    const __m256i next_lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)next_lo_));
+    const __m256i next_hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)next_hi_));
+    const __m256i nibble = _mm256_set1_epi8(0xf);
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 33 <= size; i += 32) {
+      __m256i b0 = _mm256_loadu_si256((const __m256i*)(p + i));
+      __m256i b1 = _mm256_loadu_si256((const __m256i*)(p + i + 1));
+      __m256i m0 = _mm256_and_si256(
+          _mm256_shuffle_epi8(lead_lo, _mm256_and_si256(b0, nibble)),
+          _mm256_shuffle_epi8(lead_hi, _mm256_and_si256(_mm256_srli_epi16(b0, 4), nibble)));
+      __m256i m1 = _mm256_and_si256(
+          _mm256_shuffle_epi8(next_lo, _mm256_and_si256(b1, nibble)),
+          _mm256_shuffle_epi8(next_hi, _mm256_and_si256(_mm256_srli_epi16(b1, 4), nibble)));
+      uint32_t miss = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(m0, m1), zero));
+      if (miss != 0xffffffff) {
+        return i + __builtin_ctz(~miss);
+      }
+    }
+    return FindTail(p, size, i);
   }
+#endif
+};
 
-  U8Char Retract() {
-    if (lang_ == Language::Japanese && lookahead_ == char_zero_jp_) {
-        // If current is pseudo, we want to go back to BEFORE pseudo.
-        // Pseudo consumes 3 chars (Ze, -, Ro).
-        // Current index points to Ro.
-        // So we need to go back 3 steps.
-        // Wait, if Next() sets peak_idx to Ro.
-        // No, Next sets peak_idx to Ro. 
-        // Then loop condition peak_idx++ -> Ro+1.
-        // If we are at EOF (Ro+1). Retract -> Ro.
-        // So peak_idx_ -= 1.
-        peak_idx_--; // Normal backtrack from EOF or next token
-        // But if lookahead_ was pseudo, it means we are sitting ON the token.
-        // The parser state: lookahead_ is the current token. peak_idx_ points to the last char of current token?
-        // Next: peak_idx_ += 2 (points to Ro). lookahead = pseudo.
-        // So peak_idx matches lookahead.
-        // If we Retract FROM pseudo.
-        // We want to return to state before Next() called? 
-        // No, Retract() means "Put pseudo back to input".
-        // Actually Retract means "Go back 1 token".
-        // If the previous token was ZeRo.
-        // We are currently at EOF.
-        // Retract() -> peak_idx-- (points to Ro).
-        // We need to see ZeRo.
-        // So we need to detect ZeRo at Ro.
-    } else {
-        peak_idx_--;
-    }
-    
-    lookahead_ = str_[peak_idx_];
-    
-    // Check if we landed on Ze-Ro tail (Japanese only)
-    if (lang_ == Language::Japanese && peak_idx_ >= 1) {
-         static uint32_t u_ze = GetU8Char("ゼ");
-         static uint32_t u_ro = GetU8Char("ロ");
-         // Check utf8 values from str_ (which are uint32 value)
-         if (lookahead_ == u_ro && str_[peak_idx_-1] == u_ze) {
-             lookahead_ = char_zero_jp_;
-             SISI_LOGD("Retract restored Ze-Ro at idx=%zu", peak_idx_);
-         }
-         
-         static uint32_t u_ma = GetU8Char("マ");
-         static uint32_t u_i = GetU8Char("イ");
-         static uint32_t u_na = GetU8Char("ナ");
-         static uint32_t u_su = GetU8Char("ス");
-         if (lookahead_ == u_su && peak_idx_ >= 3 && str_[peak_idx_-1] == u_na && str_[peak_idx_-2] == u_i && str_[peak_idx_-3] == u_ma) {
-             lookahead_ = char_ne_jp_alt_;
-         }
-    }
-    return lookahead_;
+/*
+   Checks that a buffer is valid UTF-8: no stray continuation byte, no char
+   cut short, no overlong form or surrogate, nothing above U+10FFFF. With
+   SSSE3 or AVX2, 16 or 32 bytes are checked at a time: the errors that each
+   pair of adjacent bytes can make are looked up in three nibble tables, and
+   the result is compared with where a third or fourth byte is due, as in
+   simdjson ("Validating UTF-8 In Less Than One Instruction Per Byte",
+   Keiser and Lemire). Blocks of ASCII only check that no char was cut short
+   before them. The end of the buffer is never read past.
+ */
+class UTF8Validator {
+public:
+  // Offset of a char boundary before which [str, str + size) is valid, size
+  // if all of it is, otherwise at most 4 bytes before the block of the first
+  // error. CharSize() finds the error from there.
+  static size_t ValidPrefix(const char* str, size_t size) {
+    static const auto valid_prefix = Pick();
+    return valid_prefix((const uint8_t*)str, size);
   }
 
-  void SavePos() {
-    peak_idx_rec_ = peak_idx_;
+  static bool IsValid(std::string_view str) {
+    return ValidPrefix(str.data(), str.size()) == str.size();
   }
 
-  void RestorePos() {
-    peak_idx_ = peak_idx_rec_;
-    lookahead_ = str_[peak_idx_];
-    // Re-detect ZeRo if needed
-    if (lang_ == Language::Japanese && peak_idx_ >= 1) {
-         static uint32_t u_ze = GetU8Char("ゼ");
-         static uint32_t u_ro = GetU8Char("ロ");
-         
-         if (lookahead_ == u_ro && str_[peak_idx_-1] == u_ze) {
-             lookahead_ = char_zero_jp_;
-         }
-
-         static uint32_t u_ma = GetU8Char("マ");
-         static uint32_t u_i = GetU8Char("イ");
-         static uint32_t u_na = GetU8Char("ナ");
-         static uint32_t u_su = GetU8Char("ス");
-         if (lookahead_ == u_su && peak_idx_ >= 3 && str_[peak_idx_-1] == u_na && str_[peak_idx_-2] == u_i && str_[peak_idx_-3] == u_ma) {
-             lookahead_ = char_ne_jp_alt_;
-         }
+  // Size of the valid char at [p, p + size), size > 0, or 0 if it is not
+  // valid. *bad is then the number of bytes that make one error, which is the
+  // longest start of a valid char there, or 1, as in the Unicode practice
+  // for U+FFFD.
+  static size_t CharSize(const uint8_t* p, size_t size, size_t* bad) {
+    uint8_t b0 = p[0];
+    if (b0 < 0x80) {
+      return 1;
+    }
+    // Range of the second byte, the others are from 0x80 to 0xbf
+    size_t len = 0;
+    uint8_t lo = 0x80, hi = 0xbf;
+    if (b0 >= 0xc2 && b0 <= 0xdf) {
+      len = 2;
+    } else if (b0 >= 0xe0 && b0 <= 0xef) {
+      len = 3;
+      lo = b0 == 0xe0 ? 0xa0 : 0x80;    // overlong below
+      hi = b0 == 0xed ? 0x9f : 0xbf;    // surrogates above
+    } else if (b0 >= 0xf0 && b0 <= 0xf4) {
+      len = 4;
+      lo = b0 == 0xf0 ? 0x90 : 0x80;
+      hi = b0 == 0xf4 ? 0x8f : 0xbf;    // above U+10FFFF
+    }
+    size_t i = 1;
+    for (; i < len && i < size && p[i] >= lo && p[i] <= hi; i++) {
+      lo = 0x80;
+      hi = 0xbf;
+    }
+    if (len > 0 && i == len) {
+      return len;
     }
+    *bad = i;
+    return 0;
   }
 
-#define SISI_IS_FIRST_O() (In(chn_dict_) || In(unit_num_[NUMBER_UNIT_J]) || (lang_ == Language::Japanese && (In(unit_num_[NUMBER_UNIT_H]) || In(unit_num_[NUMBER_UNIT_S]) || In(unit_num_[NUMBER_UNIT_M]) || In(unit_num_[NUMBER_UNIT_O]))))
-#define SISI_IS_FIRST_NE() (SISI_IS_FIRST_O() || LOOKAHEAD == char_ne_ || (lang_ == Language::Japanese && LOOKAHEAD == char_ne_jp_alt_))
+private:
+  using Impl = size_t (*)(const uint8_t*, size_t);
 
-#define LOOKAHEAD (lookahead_)
-#define LOOKAHEAD_STR (reinterpret_cast<char*>(&LOOKAHEAD))
+  // Error bits of a pair of bytes, set in all three tables when the pair
+  // makes that error
+  enum : uint8_t {
+    kTooShort     = 1 << 0,   // a lead byte not followed by a continuation byte
+    kTooLong      = 1 << 1,   // a continuation byte after an ASCII one
+    kOverlong3    = 1 << 2,
+    kTooLarge     = 1 << 3,
+    kSurrogate    = 1 << 4,
+    kOverlong2    = 1 << 5,
+    kTooLarge1000 = 1 << 6,   // above U+10FFFF, second byte 0x80 to 0x8f
+    kOverlong4    = 1 << 6,   // the same second bytes, after 0xf0
+    kTwoConts     = 1 << 7,   // an error unless a third or fourth byte is due
+    kCarry        = kTooShort | kTooLong | kTwoConts,
+  };
 
+  // Indexed by the high nibble of the first byte, the low nibble of the first
+  // byte and the high nibble of the second byte
+  static constexpr uint8_t kByte1High[16] = {
+    kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong,
+    kTwoConts, kTwoConts, kTwoConts, kTwoConts,
+    kTooShort | kOverlong2,
+    kTooShort,
+    kTooShort | kOverlong3 | kSurrogate,
+    kTooShort | kTooLarge | kTooLarge1000 | kOverlong4,
+  };
+  static constexpr uint8_t kByte1Low[16] = {
+    kCarry | kOverlong3 | kOverlong2 | kOverlong4,
+    kCarry | kOverlong2,
+    kCarry,
+    kCarry,
+    kCarry | kTooLarge,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000 | kSurrogate,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+  };
+  static constexpr uint8_t kByte2High[16] = {
+    kTooShort, kTooShort, kTooShort, kTooShort, kTooShort, kTooShort, kTooShort, kTooShort,
+    kTooLong | kOverlong2 | kTwoConts | kOverlong3 | kTooLarge1000 | kOverlong4,
+    kTooLong | kOverlong2 | kTwoConts | kOverlong3 | kTooLarge,
+    kTooLong | kOverlong2 | kTwoConts | kSurrogate | kTooLarge,
+    kTooLong | kOverlong2 | kTwoConts | kSurrogate | kTooLarge,
+    kTooShort, kTooShort, kTooShort, kTooShort,
+  };
 
-#define SISI_RETURN(x) return (x)
+  static Impl Pick() {
+#if SISI_ENABLE_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      return &ValidPrefixAVX2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+      return &ValidPrefixSSSE3;
+    }
+#endif
+    return &ValidPrefixScalar;
+  }
 
-  NumberType N(bool use_f=false) {
-    int n;
-    if (In(chn_dict_, &n)) {
-      Next(); SISI_RETURN(n);
+  static size_t ValidPrefixScalar(const uint8_t* p, size_t size) {
+    size_t i = 0, bad;
+    while (i < size) {
+      size_t n = CharSize(p + i, size - i, &bad);
+      if (n == 0) {
+        break;
+      }
+      i += n;
     }
-    SISI_RETURN(-1);
+    return i;
   }
 
-  NumberType J() {
-    NumberType n = N();
-    if (In(unit_num_[NUMBER_UNIT_J])) {
-      Next(); unit_factor_ = 10;
-      NumberType m = N(true);
-      SISI_RETURN(std::max<NumberType>(1, n) * 10 + std::max<NumberType>(0, m));
+  // Start of a char at most 4 bytes before i, everything before i having been
+  // checked but a char cut by i
+  static size_t CharStartBefore(const uint8_t* p, size_t i) {
+    size_t k = i >= 4 ? i - 4 : 0;
+    while (k < i && (p[k] & 0xc0) == 0x80) {
+      k++;
     }
-    SISI_RETURN(std::max<NumberType>(0, n));
+    return k;
   }
 
-  NumberType H() {
-    NumberType n = N(), m;
-    if (In(unit_num_[NUMBER_UNIT_H])) {
-      Next();
-      unit_factor_ = 100;
-      if (lang_ == Language::Chinese && LOOKAHEAD == char_zero_) {
-        unit_factor_ = 10; Next(); m = N();
+#if SISI_ENABLE_SIMD
+  __attribute__((target("ssse3")))
+  static __m128i ErrorsSSSE3(__m128i in, __m128i prev) {
+    const __m128i nibble = _mm_set1_epi8(0xf);
+    __m128i prev1 = _mm_alignr_epi8(in, prev, 15);
+    __m128i errors = _mm_and_si128(
+        _mm_and_si128(
+            _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)kByte1High), _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+            _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)kByte1Low), _mm_and_si128(prev1, nibble))),
+        _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)kByte2High), _mm_and_si128(_mm_srli_epi16(in, 4), nibble)));
+    // 0x80 where a third or fourth byte is due
+    __m128i third = _mm_subs_epu8(_mm_alignr_epi8(in, prev, 14), _mm_set1_epi8(0xe0 - 0x80));
+    __m128i fourth = _mm_subs_epu8(_mm_alignr_epi8(in, prev, 13), _mm_set1_epi8(0xf0 - 0x80));
+    __m128i due = _mm_and_si128(_mm_or_si128(third, fourth), _mm_set1_epi8(0x80));
+    return _mm_xor_si128(errors, due);
+  }
+
+  __attribute__((target("ssse3")))
+  static size_t ValidPrefixSSSE3(const uint8_t* p, size_t size) {
+    // Bytes that start a char longer than what is left of the block
+    const __m128i cut = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0xef, 0xdf, 0xbf);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i prev = zero, prev_cut = zero;
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+      __m128i in = _mm_loadu_si128((const __m128i*)(p + i));
+      __m128i errors = prev_cut;
+      if (_mm_movemask_epi8(in) == 0) {
+        prev_cut = zero;
+      } else {
+        errors = ErrorsSSSE3(in, prev);
+        prev_cut = _mm_subs_epu8(in, cut);
       }
-      else { m = J(); }
-      SISI_RETURN(std::max<NumberType>(1, n) * NumberType(100) + std::max<NumberType>(0, m));
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(errors, zero)) != 0xffff) {
+        return CharStartBefore(p, i);
+      }
+      prev = in;
     }
-    if (n >= 0) { Retract(); }
-    SISI_RETURN(J());
+    // The rest, followed by zeros, which also finds a char cut by the end
+    uint8_t tail[16] = {};
+    if (i < size) {
+      memcpy(tail, p + i, size - i);
+    }
+    __m128i errors = ErrorsSSSE3(_mm_loadu_si128((const __m128i*)tail), prev);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(errors, zero)) == 0xffff ? size : CharStartBefore(p, i);
   }
 
-  NumberType S() {
-    NumberType n = N(), m;
-    if (In(unit_num_[NUMBER_UNIT_S])) {
-      Next();
-      unit_factor_ = 1000;
-      if (lang_ == Language::Chinese && LOOKAHEAD == char_zero_) {
-        unit_factor_ = 10; Next(); m = J();
+  __attribute__((target("avx2")))
+  static __m256i ErrorsAVX2(__m256i in, __m256i prev) {
+    const __m256i nibble = _mm256_set1_epi8(0xf);
+    // The bytes before those of in, across the two lanes
+    __m256i before = _mm256_permute2x128_si256(prev, in, 0x21);
+    __m256i prev1 = _mm256_alignr_epi8(in, before, 15);
+    __m256i errors = _mm256_and_si256(
+        _mm256_and_si256(
+            _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)kByte1High)),
+                                _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+            _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)kByte1Low)),
+                                _mm256_and_si256(prev1, nibble))),
+        _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)kByte2High)),
+                            _mm256_and_si256(_mm256_srli_epi16(in, 4), nibble)));
+    __m256i third = _mm256_subs_epu8(_mm256_alignr_epi8(in, before, 14), _mm256_set1_epi8(0xe0 - 0x80));
+    __m256i fourth = _mm256_subs_epu8(_mm256_alignr_epi8(in, before, 13), _mm256_set1_epi8(0xf0 - 0x80));
+    __m256i due = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8(0x80));
+    return _mm256_xor_si256(errors, due);
+  }
+
+  __attribute__((target("avx2")))
+  static size_t ValidPrefixAVX2(const uint8_t* p, size_t size) {
+    const __m256i cut = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                         -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0xef, 0xdf, 0xbf);
+    __m256i prev = _mm256_setzero_si256(), prev_cut = _mm256_setzero_si256();
+    size_t i = 0;
+    // Two blocks at a time, so that the checks of one overlap with the other
+    for (; i + 64 <= size; i += 64) {
+      __m256i in0 = _mm256_loadu_si256((const __m256i*)(p + i));
+      __m256i in1 = _mm256_loadu_si256((const __m256i*)(p + i + 32));
+      __m256i errors = prev_cut;
+      if (_mm256_movemask_epi8(_mm256_or_si256(in0, in1)) == 0) {
+        prev_cut = _mm256_setzero_si256();
+      } else {
+        errors = _mm256_or_si256(ErrorsAVX2(in0, prev), ErrorsAVX2(in1, in0));
+        prev_cut = _mm256_subs_epu8(in1, cut);
       }
-      else { m = H(); }
-      SISI_RETURN(std::max<NumberType>(1, n) * NumberType(1000) + std::max<NumberType>(0, m));
+      if (!_mm256_testz_si256(errors, errors)) {
+        return CharStartBefore(p, i);
+      }
+      prev = in1;
     }
-    if (n >= 0) { Retract(); }
-    SISI_RETURN(H());
+    for (; i + 32 <= size; i += 32) {
+      __m256i in = _mm256_loadu_si256((const __m256i*)(p + i));
+      __m256i errors = ErrorsAVX2(in, prev);
+      if (!_mm256_testz_si256(errors, errors)) {
+        return CharStartBefore(p, i);
+      }
+      prev = in;
+    }
+    uint8_t tail[32] = {};
+    if (i < size) {
+      memcpy(tail, p + i, size - i);
+    }
+    __m256i errors = ErrorsAVX2(_mm256_loadu_si256((const __m256i*)tail), prev);
+    return _mm256_testz_si256(errors, errors) ? size : CharStartBefore(p, i);
   }
+#endif
+};
 
-  NumberType M() {
-    NumberType n = S(), m;
-    if (In(unit_num_[NUMBER_UNIT_M])) {
-      Next(); unit_factor_ = 10000;
-      if (lang_ == Language::Chinese && LOOKAHEAD == char_zero_) { unit_factor_ = 10; Next(); }
-      m = S();
-      SISI_RETURN(std::max<NumberType>(0, n) * NumberType(10000) + std::max<NumberType>(0, m));
-    }
-    SISI_RETURN(n);
+/*
+   Where the output of a conversion goes: a fixed buffer, a string that grows
+   as needed, or a writer that gets the output piece by piece. Appending is a
+   bounds check and a copy whatever the kind, they only differ once the space
+   runs out.
+
+     char buf[4096];
+     sisi::OutputSink sink(buf, sizeof(buf));
+     cc.Convert(text, sink);
+     fwrite(buf, 1, sink.size(), stdout);
+ */
+class OutputSink {
+public:
+  using Writer = std::function<void(std::string_view)>;
+
+  enum : size_t {
+    kWriterBufferSize = 4096,
+  };
+
+  // Write into [buf, buf + capacity). What does not fit is dropped, see
+  // truncated().
+  OutputSink(char* buf, size_t capacity)
+    : begin_(buf), pos_(buf), end_(buf + capacity) {
   }
 
-  NumberType O() {
-    NumberType n = M(), m;
-    if (In(unit_num_[NUMBER_UNIT_O])) {
-      Next(); unit_factor_ = 100000000;
-      if (lang_ == Language::Chinese && LOOKAHEAD == char_zero_) { unit_factor_ = 10; Next(); }
-      m = M();
-      SISI_RETURN(std::max<NumberType>(0, n) * NumberType(100000000) + std::max<NumberType>(0, m));
+  // Append to str, which grows as needed
+  explicit OutputSink(std::string* str)
+    : str_(str), base_(str->size()) {
+    begin_ = pos_ = end_ = str->data() + base_;
+  }
+
+  // Call writer with the output, kWriterBufferSize bytes at a time
+  explicit OutputSink(Writer writer)
+    : writer_(std::move(writer)), buffer_(kWriterBufferSize, '\0') {
+    begin_ = pos_ = buffer_.data();
+    end_ = begin_ + buffer_.size();
+  }
+
+  OutputSink(const OutputSink&) = delete;
+  OutputSink& operator=(const OutputSink&) = delete;
+
+  ~OutputSink() {
+    Flush();
+  }
+
+  void Append(const char* data, size_t size) {
+    if (size <= size_t(end_ - pos_)) {
+      memcpy(pos_, data, size);
+      pos_ += size;
+      return;
     }
-    SISI_RETURN(n);
+    AppendSlow(data, size);
   }
 
-  NumberType NE() {
-    int factor = 1;
-    if (LOOKAHEAD == char_ne_ || (lang_ == Language::Japanese && LOOKAHEAD == char_ne_jp_alt_)) {
-      Next(); factor = -1;
+  void Append(std::string_view str) {
+    Append(str.data(), str.size());
+  }
+
+  void Append(char ch) {
+    Append(&ch, 1);
+  }
+
+  void AppendNumber(int64_t num) {
+    if (end_ - pos_ >= kMaxNumberSize) {
+      pos_ = std::to_chars(pos_, end_, num).ptr;
+      return;
     }
-    if (!SISI_IS_FIRST_O()) {
-      has_error_ = true;
-      SISI_RETURN(0);
+    char buf[kMaxNumberSize];
+    Append(buf, std::to_chars(buf, buf + kMaxNumberSize, num).ptr - buf);
+  }
+
+  // Make room for at least size more bytes, if the sink can grow
+  void Reserve(size_t size) {
+    if (str_ && size > size_t(end_ - pos_)) {
+      Grow(size);
     }
-    SISI_RETURN(factor * O());
   }
 
-  NumberType ParseNumber() {
-    unit_factor_ = 1;
-    has_error_ = false;
-    NumberType num = NE();
-    if (lang_ == Language::Chinese) {
-        if (unit_factor_ > 10 && unit_factor_ <= 10000) {
-          // In oral Chinese, only tailing number less than 10 thousand can omit
-          // the tailing numeric unit (千, 百, 十)
-          auto tail_num = num % 10;
-          num = num - tail_num + tail_num * unit_factor_ / 10;
-        }
+  // Pass what is buffered to the writer, or give the string its final size
+  void Flush() {
+    if (writer_ && pos_ != begin_) {
+      writer_(std::string_view(begin_, pos_ - begin_));
+      flushed_ += pos_ - begin_;
+      pos_ = begin_;
+    } else if (str_) {
+      str_->resize(pos_ - str_->data());
+      begin_ = str_->data() + base_;
+      pos_ = end_ = str_->data() + str_->size();
     }
-    return num;
   }
 
-  const std::string& Start() {
-    has_out_ = false;
-    out_.clear();
-    out_.reserve(str_.size());
-    Next();
-    bool last_is_num = false;
-    while (LOOKAHEAD != TOKEN_TYPE_EOF) {
-      SISI_LOGD("Start loop: idx=%zu val=%lx first_ne=%d", peak_idx_, (uint64_t)LOOKAHEAD, SISI_IS_FIRST_NE());
-      if (SISI_IS_FIRST_NE()) {
-        SavePos();
-        NumberType num = ParseNumber();
-        if (has_error_) {
-          SISI_LOGD("Start loop: ParseNumber error");
-          RestorePos();
-          if (lang_ == Language::Japanese && LOOKAHEAD == char_zero_jp_) {
-              out_ += "ゼロ";
-          } else if (lang_ == Language::Japanese && LOOKAHEAD == char_ne_jp_alt_) {
-              out_ += "マイナス";
-          } else {
-#if SISI_IS_BIG_ENDIAN
-              LOOKAHEAD <<= 32;
-#endif
-              out_ += LOOKAHEAD_STR;
-          }
-          Next();
-          continue;
-        }
-        SISI_LOGD("Start loop: Parsed num %ld", (long)num);
-        // Do not add space for single number, Typically for phone numbers, years
-        if (last_is_num && num > 10) {
-          out_ += " ";
-        }
-        out_ += std::to_string(num);
-        last_is_num = true;
-      } else {
-        SISI_LOGD("Start loop: ELSE block");
-        if (LOOKAHEAD == char_pt_ && last_is_num) {
-          out_ += ".";
-        } else {
-          if (lang_ == Language::Japanese && LOOKAHEAD == char_zero_jp_) {
-              out_ += "ゼロ";
-          } else if (lang_ == Language::Japanese && LOOKAHEAD == char_ne_jp_alt_) {
-              out_ += "マイナス";
-          } else {
-#if SISI_IS_BIG_ENDIAN
-              LOOKAHEAD <<= 32;
-#endif
-              out_ += LOOKAHEAD_STR; // DANGEROUS for UTF-8?
-                // If LOOKAHEAD is Ro (30ED).
-                // It appends bytes ED 30.
-                // This explains junk "ロ" potentially if terminal decodes it luckly?
-                // Or if LOOKAHEAD_STR works by luck.
-                // We should probably handle unicode better here.
-          }
-        }
-        last_is_num = false;
-        Next();
+  // Number of bytes output so far
+  size_t size() const {
+    return flushed_ + (pos_ - begin_);
+  }
+
+  // Whether output was dropped because a fixed buffer was full
+  bool truncated() const {
+    return truncated_;
+  }
+
+private:
+  enum : int {
+    kMaxNumberSize = 20,    // -9223372036854775808
+  };
+
+  char*        begin_;
+  char*        pos_;
+  char*        end_;
+  std::string* str_       = nullptr;
+  size_t       base_      = 0;      // size of *str_ before the output
+  Writer       writer_;
+  std::string  buffer_;             // for the writer
+  size_t       flushed_   = 0;      // bytes passed to the writer
+  bool         truncated_ = false;
+
+  void AppendSlow(const char* data, size_t size) {
+    if (str_) {
+      Grow(size);
+    } else if (writer_) {
+      Flush();
+      if (size > buffer_.size()) {
+        writer_(std::string_view(data, size));
+        flushed_ += size;
+        return;
       }
+    } else {
+      size = end_ - pos_;
+      truncated_ = true;
     }
-    has_out_ = true;
-    return out_;
+    memcpy(pos_, data, size);
+    pos_ += size;
+  }
+
+  void Grow(size_t size) {
+    size_t used = pos_ - begin_;
+    str_->resize(base_ + std::max(2 * used, used + size));
+    begin_ = str_->data() + base_;
+    pos_ = begin_ + used;
+    end_ = str_->data() + str_->size();
   }
 };
 
+/*
+   The BNF Grammar is list as follows:
+
+   Negative -> 负 Kei | Kei
+   Kei -> Chou 京 Chou | Chou
+   Chou -> Oku 兆 Oku | Oku
+   Oku -> Man 亿 Man | Man
+   Man -> Sen 万 Sen | Sen
+   Sen -> NonZero 千 Hyaku | NonZero 千 零 Juu | Hyaku
+   Hyaku -> NonZero 百 Juu | NonZero 百 零 Num |
+   Juu -> NonZero 十 Num | 十 Num | Num
+   Num -> NonZero | 零
+   NonZero -> 一 | 二 | 三 | 四 | 五 | 六 | 七 | 八 | 九
+
+   兆 is 10^12 in Japanese, as above, but 10^6 in Chinese, where 万亿 is used
+   for 10^12 and Chou comes between Man and Oku. A unit from 万 up can also
+   multiply everything before it, as in 两万五千五百亿, or be repeated, as in
+   亿亿 (10^16). Values that do not fit in 64 bits are output exactly.
+ */
+
+enum class Language {
+    Chinese,
+    Japanese
+};
+
+// Parser used for the numerals. Both give the same output, the state machine
+// reads each numeral in a single forward pass and never backtracks.
+enum class ParserEngine {
+    RecursiveDescent,
+    StateMachine
+};
+
+// What a convertor does with input that is not valid UTF-8, see
+// UTF8Validator. Each invalid sequence is one error, see UTF8Errors.
+enum class UTF8ErrorPolicy : uint8_t {
+    PassThrough,  // copy the invalid bytes to the output as they are
+    Replace,      // write U+FFFD instead of each invalid sequence
+    Fail          // convert nothing, and stop at the first error
+};
+
+// Numeral chars shared by the parser and NumeralWriter. Each of them is 3
+// bytes long in UTF-8, and where there are two forms, the second one is the
+// financial one.
+struct NumeralChars {
+  static constexpr const char* kDigits[2]     = { "零一二三四五六七八九", "零壹贰叁肆伍陆柒捌玖" };
+  static constexpr const char* kSmallUnits[3] = { "十拾", "百佰", "千仟" };    // 10^1 to 10^3
+  static constexpr const char* kTwo           = "两";
+  static constexpr const char* kWan           = "万";
+  static constexpr const char* kYi[2]         = { "亿", "億" };                 // by Language
+  static constexpr const char* kZhao          = "兆";
+  static constexpr const char* kJing          = "京";
+  static constexpr const char* kNegative[2]   = { "负", "負" };                 // by Language
+  static constexpr const char* kPoint         = "点";
+};
+
+/*
+   Tokens to read besides the built-in vocabulary, each with its meaning
+   spelled in the built-in one, e.g. 〇 as 零, 廿 as 二十 or 萬 as 万. A token
+   whose meaning is a single numeral char is read exactly like that char,
+   through the same table. The others are compiled with the built-in words
+   such as ゼロ into a trie, which the lexer walks from the chars that start
+   one of them and which gives the tokens of the meaning. Each language only
+   takes the tokens whose meaning is in its own vocabulary, as 億 to 亿 is
+   only for Chinese, where 亿 is a unit.
+
+     sisi::Vocabulary vocab = sisi::Vocabulary::Common();
+     vocab.Add("两百", "二百");
+     sisi::ChineseNumberConvertor cc(sisi::Language::Chinese, sisi::ParserEngine::RecursiveDescent, &vocab);
+
+   Convertors copy what they need, so the vocabulary does not have to
+   outlive them.
+ */
+class Vocabulary {
+public:
+  enum : size_t {
+    kMaxTokenChars    = 8,
+    kMaxMeaningChars  = 4,
+    kMaxEntries       = 4096,
+  };
+
+  struct Entry {
+    std::string token;
+    std::string meaning;
+  };
+
+  // Read token as meaning. Return false if the token does not start with a
+  // 3-byte UTF-8 char, as the chars of the CJK and Kana blocks do, if
+  // either is empty or too long, or if the vocabulary is full.
+  bool Add(std::string_view token, std::string_view meaning) {
+    size_t token_chars = CountChars(token), meaning_chars = CountChars(meaning);
+    if (entries_.size() >= kMaxEntries || token_chars == 0 || token_chars > kMaxTokenChars || meaning_chars == 0 ||
+        meaning_chars > kMaxMeaningChars || ((uint8_t)token[0] & 0xf0) != 0xe0) {
+      return false;
+    }
+    entries_.push_back({ std::string(token), std::string(meaning) });
+    return true;
+  }
+
+  // Add the entries of a config with one "token meaning" pair per line,
+  // separated by spaces, tabs or =. Empty lines and lines starting with #
+  // are skipped. Return false if a line is not a valid entry, after adding
+  // the others.
+  bool Load(std::string_view config) {
+    bool ok = true;
+    while (!config.empty()) {
+      size_t eol = config.find('\n');
+      std::string_view line = config.substr(0, eol);
+      config.remove_prefix(eol == std::string_view::npos ? config.size() : eol + 1);
+      std::string_view token = NextField(line);
+      if (token.empty() || token[0] == '#') {
+        continue;
+      }
+      std::string_view meaning = NextField(line);
+      ok = NextField(line).empty() && Add(token, meaning) && ok;
+    }
+    return ok;
+  }
+
+  const std::vector<Entry>& Entries() const {
+    return entries_;
+  }
+
+  // Variant forms found in real text: 〇 in years, 幺 in phone numbers, 廿
+  // 卅 卌 in dates, and Traditional chars
+  static Vocabulary Common() {
+    Vocabulary vocab;
+    const char* pairs[][2] = {
+      { "〇", "零" }, { "幺", "一" }, { "廿", "二十" }, { "卅", "三十" }, { "卌", "四十" },
+      { "兩", "两" }, { "萬", "万" }, { "億", "亿" }, { "貳", "贰" }, { "參", "叁" },
+      { "陸", "陆" }, { "負", "负" }, { "點", "点" },
+    };
+    for (auto& pair : pairs) {
+      vocab.Add(pair[0], pair[1]);
+    }
+    return vocab;
+  }
+
+private:
+  std::vector<Entry> entries_;
+
+  static size_t CountChars(std::string_view str) {
+    return std::count_if(str.begin(), str.end(), [](char ch) { return ((uint8_t)ch & 0xc0) != 0x80; });
+  }
+
+  // Take the first field of line off it
+  static std::string_view NextField(std::string_view& line) {
+    const char* kSeparators = " \t\r=";
+    size_t begin = line.find_first_not_of(kSeparators);
+    if (begin == std::string_view::npos) {
+      line = {};
+      return {};
+    }
+    size_t end = std::min(line.find_first_of(kSeparators, begin), line.size());
+    std::string_view field = line.substr(begin, end - begin);
+    line.remove_prefix(end);
+    return field;
+  }
+};
+
+/*
+   Phrases whose numerals are kept as they are, such as the idioms 一石二鸟
+   and 三心二意, each with the text that has to come before and after it, if
+   any. An entry is written as the phrase alone, or as left[phrase]right, as
+   in 乱[七八糟] or [一]会儿, and a phrase may have several entries, one of
+   which has to match. Where a numeral could start, the convertor looks up
+   the longest phrase there whose context matches and copies it, instead of
+   parsing a numeral, so a phrase has to start with the char a numeral would,
+   such as 七 in 乱[七八糟].
+
+   The phrases are compiled into a double-array trie over their UTF-8 bytes,
+   which takes two loads per byte to walk. It is laid out in a single image,
+   which Save() writes as it is and Map() maps back into memory without any
+   parsing, so that a large lexicon costs nothing to open.
+
+     sisi::PhraseLexicon lexicon = sisi::PhraseLexicon::Idioms();
+     lexicon.Load("统[一]\n");
+     cc.SetLexicon(&lexicon);
+
+   Convertors only borrow a lexicon, which must outlive them.
+ */
+class PhraseLexicon {
+public:
+  enum : size_t {
+    kMaxPhraseSize  = 64,     // bytes of a phrase or of a context
+    kMaxEntries     = 1 << 20,
+  };
+
+  PhraseLexicon() = default;
+
+  PhraseLexicon(PhraseLexicon&& other) noexcept {
+    *this = std::move(other);
+  }
+
+  PhraseLexicon& operator=(PhraseLexicon&& other) noexcept {
+    if (this != &other) {
+      Unmap();
+      entries_ = std::move(other.entries_);
+      image_ = std::move(other.image_);     // keeps its buffer, where other points
+      std::swap(map_, other.map_);
+      std::swap(map_size_, other.map_size_);
+      Attach(other.header_);
+      other.Attach(nullptr);
+    }
+    return *this;
+  }
+
+  PhraseLexicon(const PhraseLexicon&) = delete;
+  PhraseLexicon& operator=(const PhraseLexicon&) = delete;
+
+  ~PhraseLexicon() {
+    Unmap();
+  }
+
+  // Add the entries of a config with one entry per line, skipping empty
+  // lines and lines starting with #, and compile them with the ones added
+  // before, or the ones mapped by Map(). Return false if a line is not a
+  // valid entry, after adding the others.
+  bool Load(std::string_view config) {
+    if (header_ != nullptr && entries_.empty()) {
+      std::string phrase;
+      Unpack(0, phrase);
+    }
+    bool ok = true;
+    while (!config.empty()) {
+      size_t eol = config.find('\n');
+      std::string_view line = config.substr(0, eol);
+      config.remove_prefix(eol == std::string_view::npos ? config.size() : eol + 1);
+      size_t begin = line.find_first_not_of(" \t\r");
+      if (begin == std::string_view::npos || line[begin] == '#') {
+        continue;
+      }
+      line = line.substr(begin, line.find_last_not_of(" \t\r") + 1 - begin);
+      ok = Add(line) && ok;
+    }
+    Compile();
+    return ok;
+  }
+
+  // Write the compiled lexicon to path, for Map(). Return false if it
+  // cannot be written.
+  bool Save(const char* path) const {
+    Header empty = EmptyHeader();
+    const Header* image = header_ ? header_ : &empty;
+    size_t size = ImageSize(*image);
+    FILE* f = fopen(path, "wb");
+    if (f == nullptr) {
+      return false;
+    }
+    bool ok = fwrite(image, 1, size, f) == size;
+    return fclose(f) == 0 && ok;
+  }
+
+  // Replace the lexicon with the one in a file written by Save() on a
+  // machine of the same byte order. Return false, leaving the lexicon
+  // empty, if the file cannot be read or is not such a file.
+  bool Map(const char* path) {
+    Unmap();
+    entries_.clear();
+    image_.clear();
+    Attach(nullptr);
+#if SISI_ENABLE_MMAP
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st;
+    void* map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(Header)) {
+      map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+      return false;
+    }
+    if (!IsValidImage(map, st.st_size)) {
+      munmap(map, st.st_size);
+      return false;
+    }
+    map_ = map;
+    map_size_ = st.st_size;
+    Attach(map_);
+#else
+    FILE* f = fopen(path, "rb");
+    if (f == nullptr) {
+      return false;
+    }
+    std::vector<uint64_t> image;
+    uint64_t buf[512];
+    size_t size = 0, n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+      image.resize((size + n + 7) / 8);
+      memcpy((uint8_t*)image.data() + size, buf, n);
+      size += n;
+    }
+    fclose(f);
+    if (!IsValidImage(image.data(), size)) {
+      return false;
+    }
+    image_ = std::move(image);
+    Attach(image_.data());
+#endif
+    return true;
+  }
+
+  bool empty() const {
+    return rules_size_ == 0;
+  }
+
+  // End of the longest phrase at pos in text whose context matches, or pos
+  // if there is none
+  size_t Match(std::string_view text, size_t pos) const {
+    size_t end = pos;
+    uint32_t node = 0;
+    if (units_size_ == 0) {
+      return end;
+    }
+    for (size_t i = pos; ; i++) {
+      uint32_t leaf = units_[node].base;
+      if (leaf < units_size_ && units_[leaf].check == node && ContextMatches(units_[leaf].base, text, pos, i)) {
+        end = i;
+      }
+      if (i == text.size()) {
+        break;
+      }
+      uint32_t next = units_[node].base + (uint8_t)text[i] + 1;
+      if (next >= units_size_ || units_[next].check != node) {
+        break;
+      }
+      node = next;
+    }
+    return end;
+  }
+
+  // Idioms and set phrases whose numerals are not numbers
+  static PhraseLexicon Idioms() {
+    PhraseLexicon lexicon;
+    lexicon.Load(
+      "一石二鸟\n一石二鳥\n一心一意\n三心二意\n一五一十\n一干二净\n一清二楚\n一模一样\n一举两得\n"
+      "三番五次\n三言两语\n四面八方\n五颜六色\n七上八下\n七嘴八舌\n九牛一毛\n十全十美\n"
+      "乱[七八糟]\n接[二连三]\n独[一无二]\n万无[一失]\n说[一不二]\n[一]会儿\n[一]下子\n");
+    return lexicon;
+  }
+
+private:
+  struct Entry {
+    std::string phrase;
+    std::string left;
+    std::string right;
+  };
+
+  // Start of the image, whose units, rules and pool of context bytes follow
+  struct Header {
+    char     magic[8];
+    uint32_t byte_order;
+    uint32_t units;
+    uint32_t rules;
+    uint32_t pool;
+    uint64_t reserved;
+  };
+
+  // A node of the trie. The child of a node with byte b is at base + b + 1
+  // and has the node as its check, and the phrase that ends at the node has
+  // its first rule in the base of the unit at base.
+  struct Unit {
+    uint32_t base;
+    uint32_t check;
+  };
+
+  // Context of one entry, as byte ranges of the pool
+  struct Rule {
+    uint32_t left;
+    uint32_t right;
+    uint16_t left_size;
+    uint16_t right_size;
+    uint32_t last;            // the last rule of the phrase
+  };
+
+  static constexpr char     kMagic[8]  = { 'S', 'I', 'S', 'I', 'L', 'E', 'X', '1' };
+  static constexpr uint32_t kByteOrder = 0x01020304;
+  static constexpr uint32_t kFree      = ~uint32_t(0);
+
+  std::vector<Entry>    entries_;
+  std::vector<uint64_t> image_;     // if compiled here
+  void*                 map_ = nullptr;
+  size_t                map_size_ = 0;
+  const Header*         header_ = nullptr;
+  const Unit*           units_ = nullptr;
+  const Rule*           rules_ = nullptr;
+  const char*           pool_ = nullptr;
+  uint32_t              units_size_ = 0;
+  uint32_t              rules_size_ = 0;
+  uint32_t              pool_size_ = 0;
+
+  bool Add(std::string_view line) {
+    Entry e;
+    size_t open = line.find('['), close = line.find(']');
+    if (open == std::string_view::npos && close == std::string_view::npos) {
+      e.phrase = line;
+    } else if (open < close && close != std::string_view::npos &&
+               line.find_first_of("[]", open + 1) == close && line.find_first_of("[]", close + 1) == std::string_view::npos) {
+      e.left = line.substr(0, open);
+      e.phrase = line.substr(open + 1, close - open - 1);
+      e.right = line.substr(close + 1);
+    } else {
+      return false;
+    }
+    if (entries_.size() >= kMaxEntries || e.phrase.empty() || e.phrase.size() > kMaxPhraseSize ||
+        e.left.size() > kMaxPhraseSize || e.right.size() > kMaxPhraseSize ||
+        line.find_first_of(" \t") != std::string_view::npos) {
+      return false;
+    }
+    entries_.push_back(std::move(e));
+    return true;
+  }
+
+  // Add to entries_ the ones of the image under node, which is reached by
+  // phrase. A damaged image may give wrong entries, but never reads out of
+  // bounds.
+  void Unpack(uint32_t node, std::string& phrase) {
+    if (node >= units_size_ || phrase.size() > kMaxPhraseSize) {
+      return;
+    }
+    uint32_t base = units_[node].base;
+    for (uint32_t label = 0; label <= 256 && uint64_t(base) + label < units_size_; label++) {
+      uint32_t child = base + label;
+      if (units_[child].check != node) {
+        continue;
+      }
+      if (label > 0) {
+        phrase.push_back(char(label - 1));
+        Unpack(child, phrase);
+        phrase.pop_back();
+        continue;
+      }
+      for (uint32_t rule = units_[child].base; rule < rules_size_ && entries_.size() < kMaxEntries; rule++) {
+        const Rule& r = rules_[rule];
+        if (uint64_t(r.left) + r.left_size <= pool_size_ && uint64_t(r.right) + r.right_size <= pool_size_) {
+          entries_.push_back({ phrase, std::string(pool_ + r.left, r.left_size), std::string(pool_ + r.right, r.right_size) });
+        }
+        if (r.last) {
+          break;
+        }
+      }
+    }
+  }
+
+  // Build the image from entries_, with the rules of each phrase together
+  void Compile() {
+    Unmap();
+    std::vector<const Entry*> sorted;
+    for (auto& e : entries_) {
+      sorted.push_back(&e);
+    }
+    std::stable_sort(sorted.begin(), sorted.end(), [](const Entry* a, const Entry* b) { return a->phrase < b->phrase; });
+    std::vector<Rule> rules;
+    std::string pool;
+    std::vector<uint32_t> first_rule;   // of each distinct phrase
+    std::vector<std::string_view> phrases;
+    for (size_t i = 0; i < sorted.size(); i++) {
+      if (i == 0 || sorted[i]->phrase != sorted[i - 1]->phrase) {
+        if (!rules.empty()) {
+          rules.back().last = 1;
+        }
+        first_rule.push_back(rules.size());
+        phrases.push_back(sorted[i]->phrase);
+      }
+      rules.push_back({ uint32_t(pool.size()), uint32_t(pool.size() + sorted[i]->left.size()),
+                        uint16_t(sorted[i]->left.size()), uint16_t(sorted[i]->right.size()), 0 });
+      pool += sorted[i]->left;
+      pool += sorted[i]->right;
+    }
+    if (!rules.empty()) {
+      rules.back().last = 1;
+    }
+
+    std::vector<Unit> units(1, { 0, kFree });
+    uint32_t first_free = 1;
+    if (!phrases.empty()) {
+      BuildTrie(phrases, first_rule, 0, phrases.size(), 0, 0, units, &first_free);
+    }
+    Header header = EmptyHeader();
+    header.units = units.size();
+    header.rules = rules.size();
+    header.pool = pool.size();
+    size_t size = ImageSize(header);
+    image_.assign((size + 7) / 8, 0);
+    uint8_t* p = (uint8_t*)image_.data();
+    memcpy(p, &header, sizeof(header));
+    p += sizeof(header);
+    memcpy(p, units.data(), units.size() * sizeof(Unit));
+    p += units.size() * sizeof(Unit);
+    memcpy(p, rules.data(), rules.size() * sizeof(Rule));
+    p += rules.size() * sizeof(Rule);
+    memcpy(p, pool.data(), pool.size());
+    Attach(image_.data());
+  }
+
+  // Place the children of node, which are the next bytes of the phrases
+  // [begin, end) after depth bytes, at the first base where they all fit,
+  // and then their own children. A phrase that ends there takes label 0.
+  // Every unit before first_free is taken.
+  static void BuildTrie(const std::vector<std::string_view>& phrases, const std::vector<uint32_t>& first_rule,
+                        size_t begin, size_t end, size_t depth, uint32_t node, std::vector<Unit>& units,
+                        uint32_t* first_free) {
+    std::vector<uint32_t> labels;
+    for (size_t i = begin; i < end; i++) {
+      uint32_t label = Label(phrases[i], depth);
+      if (labels.empty() || labels.back() != label) {
+        labels.push_back(label);
+      }
+    }
+    uint32_t base = std::max<uint32_t>(1, *first_free - std::min(*first_free, labels.front()));
+    while (!std::all_of(labels.begin(), labels.end(),
+                        [&](uint32_t label) { return base + label >= units.size() || units[base + label].check == kFree; })) {
+      base++;
+    }
+    units[node].base = base;
+    if (units.size() <= base + labels.back()) {
+      units.resize(base + labels.back() + 1, { 0, kFree });
+    }
+    for (uint32_t label : labels) {
+      units[base + label].check = node;
+    }
+    while (*first_free < units.size() && units[*first_free].check != kFree) {
+      ++*first_free;
+    }
+    size_t i = begin;
+    for (uint32_t label : labels) {
+      size_t j = i;
+      while (j < end && Label(phrases[j], depth) == label) {
+        j++;
+      }
+      if (label == 0) {
+        units[base].base = first_rule[i];
+      } else {
+        BuildTrie(phrases, first_rule, i, j, depth + 1, base + label, units, first_free);
+      }
+      i = j;
+    }
+  }
+
+  // Label of the byte of phrase after depth bytes, or 0 where it ends
+  static uint32_t Label(std::string_view phrase, size_t depth) {
+    return phrase.size() == depth ? 0 : uint32_t((uint8_t)phrase[depth]) + 1;
+  }
+
+  bool ContextMatches(uint32_t rule, std::string_view text, size_t begin, size_t end) const {
+    for (; rule < rules_size_; rule++) {
+      const Rule& r = rules_[rule];
+      // Checked here rather than in Map(), whose cost does not grow with the
+      // size of the file
+      if (r.left_size <= begin && r.right_size <= text.size() - end &&
+          uint64_t(r.left) + r.left_size <= pool_size_ && uint64_t(r.right) + r.right_size <= pool_size_ &&
+          memcmp(text.data() + begin - r.left_size, pool_ + r.left, r.left_size) == 0 &&
+          memcmp(text.data() + end, pool_ + r.right, r.right_size) == 0) {
+        return true;
+      }
+      if (r.last) {
+        break;
+      }
+    }
+    return false;
+  }
+
+  static Header EmptyHeader() {
+    Header header = {};
+    memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.byte_order = kByteOrder;
+    return header;
+  }
+
+  static uint64_t ImageSize(const Header& h) {
+    return sizeof(Header) + uint64_t(h.units) * sizeof(Unit) + uint64_t(h.rules) * sizeof(Rule) + h.pool;
+  }
+
+  // Match() checks every index it reads from the image against the sizes,
+  // so a damaged file cannot make it read out of bounds
+  static bool IsValidImage(const void* image, size_t size) {
+    const Header* h = (const Header*)image;
+    return size >= sizeof(Header) && memcmp(h->magic, kMagic, sizeof(kMagic)) == 0 && h->byte_order == kByteOrder &&
+           h->units != kFree && size == ImageSize(*h);
+  }
+
+  // Point at the image, or at nothing
+  void Attach(const void* image) {
+    header_ = (const Header*)image;
+    if (image == nullptr) {
+      units_ = nullptr;
+      rules_ = nullptr;
+      pool_ = nullptr;
+      units_size_ = 0;
+      rules_size_ = 0;
+      pool_size_ = 0;
+      return;
+    }
+    const Header* h = (const Header*)image;
+    units_ = (const Unit*)(h + 1);
+    rules_ = (const Rule*)(units_ + h->units);
+    pool_ = (const char*)(rules_ + h->rules);
+    units_size_ = h->units;
+    rules_size_ = h->rules;
+    pool_size_ = h->pool;
+  }
+
+  void Unmap() {
+#if SISI_ENABLE_MMAP
+    if (map_) {
+      munmap(map_, map_size_);
+    }
+#endif
+    map_ = nullptr;
+    map_size_ = 0;
+  }
+};
+
+enum class NumeralKind : uint8_t {
+    Digit,      // a single digit, adjacent ones usually form a phone number or a year
+    Number      // a numeral with units, e.g. 三千五百
+};
+
+// A numeral found by ChineseNumberConvertor::Extract(). For a decimal such as
+// 三点一四, the span covers the whole of it and value is the integer part.
+struct NumeralSpan {
+  size_t      byte_begin;
+  size_t      byte_end;
+  int64_t     value;
+  bool        is_negative;    // also set for 负零, whose value is 0
+  bool        has_decimal;
+  bool        is_clamped;     // the value does not fit in int64_t and is its limit
+  NumeralKind kind;
+};
+
+// What the last conversion of a convertor did, see Stats(). Only collected
+// when SISI_ENABLE_STATS is 1, otherwise all zero.
+struct ConversionStats {
+  uint64_t codepoints;      // decoded by the parser
+  uint64_t skipped_bytes;   // passed through without decoding, see NumeralScanner
+  uint64_t numerals;
+  uint64_t retracts;        // steps back by one token, see Retract()
+  uint64_t restores;        // backtracking to a saved position, see RestorePos()
+  uint64_t parse_errors;    // numerals given up, whose text is copied instead
+  uint64_t output_bytes;
+  uint64_t elapsed_ns;
+};
+
+// Where the input of the last conversion of a convertor is not valid UTF-8,
+// see InvalidUTF8(). Collected whatever SISI_ENABLE_STATS.
+struct UTF8Errors {
+  size_t count;           // invalid sequences, at most 1 with UTF8ErrorPolicy::Fail
+  size_t first_offset;    // byte offset of the first one, if count > 0
+};
+
+/*
+   Distribution of ConversionStats over many conversions. Each metric has
+   power of two buckets: bucket 0 counts zeros and bucket i the values in
+   [2^(i-1), 2^i). Add() and Merge() can be called from any thread, so that
+   several threads can share one histogram, or keep their own and merge them
+   into a process-wide one from time to time.
+
+     sisi::StatsHistogram hist;
+     cc.Convert(text);
+     hist.Add(cc.Stats());
+     uint64_t p99 = hist.Quantile(sisi::StatsHistogram::kElapsedNs, 0.99);
+ */
+class StatsHistogram {
+public:
+  enum Metric : int {
+    kCodepoints,
+    kSkippedBytes,
+    kNumerals,
+    kRetracts,
+    kRestores,
+    kParseErrors,
+    kOutputBytes,
+    kElapsedNs,
+    kMetricCount,
+  };
+
+  enum : int {
+    kBuckets = 65,
+  };
+
+  StatsHistogram() {
+    Clear();
+  }
+
+  StatsHistogram(const StatsHistogram&) = delete;
+  StatsHistogram& operator=(const StatsHistogram&) = delete;
+
+  void Add(const ConversionStats& stats) {
+    const uint64_t values[kMetricCount] = {
+      stats.codepoints, stats.skipped_bytes, stats.numerals, stats.retracts,
+      stats.restores, stats.parse_errors, stats.output_bytes, stats.elapsed_ns,
+    };
+    for (int m = 0; m < kMetricCount; m++) {
+      buckets_[m][BucketOf(values[m])].fetch_add(1, std::memory_order_relaxed);
+      sums_[m].fetch_add(values[m], std::memory_order_relaxed);
+    }
+    count_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Add all the conversions counted by other
+  void Merge(const StatsHistogram& other) {
+    for (int m = 0; m < kMetricCount; m++) {
+      for (int b = 0; b < kBuckets; b++) {
+        buckets_[m][b].fetch_add(other.Count((Metric)m, b), std::memory_order_relaxed);
+      }
+      sums_[m].fetch_add(other.Sum((Metric)m), std::memory_order_relaxed);
+    }
+    count_.fetch_add(other.Conversions(), std::memory_order_relaxed);
+  }
+
+  void Clear() {
+    for (int m = 0; m < kMetricCount; m++) {
+      for (int b = 0; b < kBuckets; b++) {
+        buckets_[m][b].store(0, std::memory_order_relaxed);
+      }
+      sums_[m].store(0, std::memory_order_relaxed);
+    }
+    count_.store(0, std::memory_order_relaxed);
+  }
+
+  // Number of conversions added
+  uint64_t Conversions() const {
+    return count_.load(std::memory_order_relaxed);
+  }
+
+  // Number of conversions whose metric falls into bucket
+  uint64_t Count(Metric metric, int bucket) const {
+    return buckets_[metric][bucket].load(std::memory_order_relaxed);
+  }
+
+  // Sum of the metric over all conversions
+  uint64_t Sum(Metric metric) const {
+    return sums_[metric].load(std::memory_order_relaxed);
+  }
+
+  // Upper bound of the bucket holding the q-th quantile of the metric, with
+  // q in [0, 1]
+  uint64_t Quantile(Metric metric, double q) const {
+    uint64_t count = Conversions();
+    uint64_t rank = std::min<uint64_t>((uint64_t)(q * count), count ? count - 1 : 0);
+    uint64_t seen = 0;
+    for (int b = 0; b < kBuckets; b++) {
+      seen += Count(metric, b);
+      if (seen > rank) {
+        return UpperBound(b);
+      }
+    }
+    return UpperBound(kBuckets - 1);
+  }
+
+  // Largest value counted in bucket
+  static uint64_t UpperBound(int bucket) {
+    return bucket == 0 ? 0 : bucket == 64 ? UINT64_MAX : (uint64_t(1) << bucket) - 1;
+  }
+
+  static int BucketOf(uint64_t value) {
+    int bucket = 0;
+    while (value) {
+      value >>= 1;
+      bucket++;
+    }
+    return bucket;
+  }
+
+private:
+  std::atomic<uint64_t> buckets_[kMetricCount][kBuckets];
+  std::atomic<uint64_t> sums_[kMetricCount];
+  std::atomic<uint64_t> count_;
+};
+
+// Where the parser starts reading a numeral or a run of other text, see
+// IncrementalConvertor. The parser continues from there the same way whatever
+// comes before, provided last_is_num is the same.
+struct SegmentBoundary {
+  size_t in;            // byte offset in the input
+  size_t out;           // byte offset in the output
+  size_t reach;         // end of what was read to get here, see UTF8String::Frontier()
+  bool   last_is_num;
+};
+
+/*
+   The convertor for one language. The language is a template parameter, so
+   that the checks for the rules of the other language are compiled out of
+   the hot path. ChineseNumberConvertor picks one of them at run time.
+ */
+template <Language L>
+class BasicNumberConvertor {
+public:
+  using U8Char = uint64_t;
+  using NumberType = int64_t;
+#if defined(__SIZEOF_INT128__)
+  using WideType = __int128;      // fast accumulator, see WideAcc
+#else
+  using WideType = int64_t;
+#endif
+
+  enum : size_t {
+    kMaxSegmentSize = 256,    // of a run of text without numerals, see IncrementalConvertor
+    kMaxArabicDigits = 15,    // of a run of digits read with a unit, as in 3万
+  };
+
+  // The input is borrowed, not copied, and must outlive the convertor. With
+  // a vocab, the convertor also reads its tokens, see Vocabulary.
+  explicit BasicNumberConvertor(const char* str, ParserEngine engine = ParserEngine::RecursiveDescent,
+                                const Vocabulary* vocab = nullptr)
+    : str_(str), engine_(engine),
+      own_dict_(vocab ? std::make_shared<const NumDict>(InitializeNumDict(L, vocab)) : nullptr),
+      dict_(own_dict_ ? *own_dict_ : GetNumDict()) {
+    CheckUTF8(str_.View());
+  }
+
+  // Create an empty convertor, to be fed with Reset() or Convert()
+  explicit BasicNumberConvertor(ParserEngine engine = ParserEngine::RecursiveDescent,
+                                const Vocabulary* vocab = nullptr)
+    : BasicNumberConvertor("", engine, vocab) {
+  }
+
+  // Start over with a new input, which is borrowed like in the constructor.
+  // The output buffer is kept, so a long-lived convertor does not allocate
+  // once it has warmed up. The input is checked to be valid UTF-8, see
+  // SetUTF8ErrorPolicy().
+  void Reset(std::string_view str) {
+    Restart(str);
+    CheckUTF8(str);
+  }
+
+  // What to do with the next inputs where they are not valid UTF-8. With
+  // Replace, the byte offsets of Extract() are those of the input with
+  // U+FFFD. With Fail, the output is empty, and so are the spans.
+  void SetUTF8ErrorPolicy(UTF8ErrorPolicy policy) {
+    utf8_policy_ = policy;
+  }
+
+  const UTF8Errors& InvalidUTF8() const {
+    return utf8_errors_;
+  }
+
+  // Keep the phrases of lexicon as they are, or none with nullptr. The
+  // lexicon is borrowed and must outlive the convertor.
+  void SetLexicon(const PhraseLexicon* lexicon) {
+    lexicon_ = lexicon && !lexicon->empty() ? lexicon : nullptr;
+  }
+
+  const std::string& Convert(std::string_view str) {
+    Reset(str);
+    return Evaluate();
+  }
+
+  // Convert into a sink instead of the buffer of the convertor. The sink is
+  // flushed at the end.
+  void Convert(std::string_view str, OutputSink& sink) {
+    Reset(str);
+    Start(sink);
+  }
+
+  const std::string& Evaluate() {
+    if (!has_out_) return Start();
+    return out_;
+  }
+
+  const std::string& operator()() {
+    return Evaluate();
+  }
+
+  // Find the numerals of the input without building the output. The spans
+  // are valid until the next call.
+  const std::vector<NumeralSpan>& Extract() {
+    return Extract(str_.View());
+  }
+
+  const std::vector<NumeralSpan>& Extract(std::string_view str) {
+    Reset(str);
+    return StartExtract();
+  }
+
+  // What the last conversion or extraction did. All zero unless built with
+  // SISI_ENABLE_STATS.
+  const ConversionStats& Stats() const {
+    return stats_;
+  }
+
+private:
+  // What a token is to the parser, so that it never has to look it up again.
+  // The order is that of the columns of kTransitions.
+  enum TokenClass : uint8_t {
+    TC_OTHER,
+    TC_DIGIT,
+    TC_ZERO,      // 零 in Chinese, where it is also a separator after a unit
+    TC_TEN,
+    TC_HUNDRED,
+    TC_THOUSAND,
+    TC_BIG_UNIT,  // 万 and above
+    // Runs of ASCII or full-width digits, see LexArabic()
+    TC_ARABIC,          // followed by a unit, as in 3万 or 1.5亿: a section
+    TC_ARABIC_DIGIT,    // a digit inside a numeral, as in 2千零5
+    TC_ARABIC_SECTION,  // a section after 万 and above, as in 3万5000
+    TC_COUNT,
+  };
+
+  struct CharClass {
+    TokenClass cls;
+    int8_t     num;           // value of a digit, or power of ten of a unit
+    uint16_t   word;          // node of NumDict::trie the char leads to from the root, or 0
+  };
+
+  // Class of every char, looked up without a branch in two levels indexed by
+  // the payload bits of a 3-byte UTF-8 char, which covers the CJK and Kana
+  // blocks: 4 bits of the first byte and 6 of the second pick a block of 64
+  // chars, and 6 bits of the third the char in it. Blocks without a numeral
+  // char share block 0, which is all TC_OTHER. Index 0 would be an overlong
+  // char, so chars of other lengths are sent there as well.
+  class CharClassTable {
+  public:
+    CharClassTable()
+      : blocks_(1) {
+      index_.fill(0);
+    }
+
+    // ch must be a 3-byte char
+    void Set(uint32_t ch, CharClass c) {
+      uint16_t& block = index_[Index(ch)];
+      if (block == 0) {
+        block = blocks_.size();
+        blocks_.emplace_back();
+      }
+      blocks_[block][Byte(ch, 2) & 0x3f] = c;
+    }
+
+    CharClass operator[](uint32_t ch) const {
+      return blocks_[index_[Index(ch)]][Byte(ch, 2) & 0x3f];
+    }
+
+  private:
+    std::array<uint16_t, 1024>              index_;
+    std::vector<std::array<CharClass, 64>>  blocks_;
+
+    // Byte i of a char as packed by UTF8String
+    static uint32_t Byte(uint32_t ch, int i) {
+#if SISI_ENABLE_LITTLE_ENDIAN
+      return (ch >> (8 * i)) & 0xff;
+#else
+      return (ch >> (24 - 8 * i)) & 0xff;
+#endif
+    }
+
+    static size_t Index(uint32_t ch) {
+      uint32_t b0 = Byte(ch, 0);
+      uint32_t three_bytes = -uint32_t((b0 & 0xf0) == 0xe0 && Byte(ch, 3) == 0);
+      return (((b0 & 0x0f) << 6) | (Byte(ch, 1) & 0x3f)) & three_bytes;
+    }
+  };
+
+  // What a token of the trie is read as: its meaning, one or more tokens of
+  // the built-in vocabulary, or a pseudo char standing for a word like ゼロ
+  struct Expansion {
+    struct Part {
+      U8Char    value;
+      CharClass cls;
+    };
+
+    size_t size;
+    Part   parts[Vocabulary::kMaxMeaningChars];
+  };
+
+  struct TrieNode {
+    std::vector<std::pair<uint32_t, uint32_t>> next;   // a char and the node it leads to
+    int32_t expansion = -1;   // of the token ending here, if any
+  };
+
+  // A token of the input, see Lex()
+  struct Token {
+    U8Char     value;
+    size_t     begin;     // byte range in the input
+    size_t     end;
+    TokenClass cls;
+    int8_t     num;       // as in CharClass, or see LexArabic()
+  };
+
+  // Numeral tables of one language. They are built once per process and
+  // shared read-only by every convertor, see GetNumDict().
+  struct NumDict {
+    U8Char            char_ne;
+    U8Char            char_pt;
+    U8Char            char_ne_jp_alt;
+    CharClassTable         classes;      // chars that are not TC_OTHER, or start a token of trie
+    std::vector<TrieNode>  trie;         // tokens of several chars, or not read as they are
+    std::vector<Expansion> expansions;
+    NumeralScanner         scanner;
+
+    // Node reached from node with ch, or 0, the root, if there is none. The
+    // children of the root are in the class table.
+    uint32_t Child(uint32_t node, uint32_t ch) const {
+      if (node == 0) {
+        return classes[ch].word;
+      }
+      for (auto& [c, child] : trie[node].next) {
+        if (c == ch) {
+          return child;
+        }
+      }
+      return 0;
+    }
+  };
+
+  // Value of a numeral with units from 万 up, and the units read so far. It
+  // is computed in WideType, and only once that overflows, as a string of
+  // decimal digits. The sections since the last unit that multiplied the
+  // whole value are kept apart in group, which a larger unit may still
+  // multiply, as 亿 does in 一亿亿三千万零五亿.
+  struct WideAcc {
+    enum : int {
+      kMaxExp = sizeof(WideType) == 16 ? 38 : 18,   // largest 10^n in WideType
+    };
+
+    WideType    value;
+    WideType    group;
+    bool        is_big;
+    std::string digits;       // least significant first, once is_big
+    int         top_exp;      // power of ten of the whole value so far
+    int         last_exp;     // of the last unit
+    bool        at_top;       // the last unit multiplied the whole value
+    size_t      unit_end;     // index of the char after the last unit
+
+    void Clear() {
+      value    = 0;
+      group    = 0;
+      is_big   = false;
+      top_exp  = 0;
+      last_exp = 0;
+      at_top   = false;
+      unit_end = -1;
+    }
+
+    // Apply the unit 10^exp to the section before it, or return false if the
+    // unit cannot follow the ones read so far. A unit larger than everything
+    // so far, or repeated right after itself, multiplies the whole value, as
+    // in 两万五千五百亿 or 亿亿. A smaller one only multiplies its section,
+    // and a larger one than the last also the group before it, as long as it
+    // stays below the whole value, as in 一亿亿三千万零五亿 or 一亿亿零五亿.
+    // A unit that would multiply nothing, after a zero section as in 零亿 or
+    // after an empty one that it cannot stack on as in 一亿万, cannot follow.
+    bool Push(NumberType section, int exp, bool empty) {
+      WideType t;
+      switch (Fit(section, exp, empty, &t)) {
+        case kNoFit:
+          return false;
+        case kFitWhole:
+          Add(group, 0);
+          Add(section, 0);
+          Shift(exp);
+          group = 0;
+          top_exp += exp;
+          at_top = true;
+          break;
+        case kFitGroup:
+          group = t;
+          at_top = false;
+          break;
+      }
+      last_exp = exp;
+      return true;
+    }
+
+    enum UnitFit { kNoFit, kFitWhole, kFitGroup };
+
+    // How Push() would apply the unit, with the new group in *group_out if
+    // it only multiplies the group
+    UnitFit Fit(NumberType section, int exp, bool empty, WideType* group_out) const {
+      if (section == 0 && (!empty || exp < last_exp)) {
+        return kNoFit;
+      }
+      if (exp > top_exp || (at_top && exp == last_exp && empty)) {
+        return kFitWhole;
+      }
+      if (exp < last_exp) {
+        WideType t;
+        if (MulOverflow(section, Pow10(exp), &t) || AddOverflow(group, t, group_out)) {
+          return kNoFit;
+        }
+        return kFitGroup;
+      }
+      if ((exp > last_exp || at_top) && top_exp - exp <= kMaxExp &&
+          group + section < Pow10(top_exp - exp)) {
+        *group_out = (group + section) * Pow10(exp);
+        return kFitGroup;
+      }
+      return kNoFit;
+    }
+
+    // Add the last section
+    void Finish(NumberType section) {
+      Add(group, 0);
+      Add(section, 0);
+      group = 0;
+    }
+
+    // value += n * 10^exp
+    void Add(WideType n, int exp) {
+      if (n == 0) {
+        return;
+      }
+      WideType t;
+      if (!is_big && exp <= kMaxExp && !MulOverflow(n, Pow10(exp), &t) && !AddOverflow(value, t, &t)) {
+        value = t;
+        return;
+      }
+      ToDigits();
+      for (size_t i = exp; n > 0; i++, n /= 10) {
+        if (i >= digits.size()) {
+          digits.resize(i + 1, '0');
+        }
+        int d = digits[i] - '0' + n % 10;
+        digits[i] = '0' + d % 10;
+        n += d / 10 * 10;     // carry
+      }
+    }
+
+    // value *= 10^exp
+    void Shift(int exp) {
+      WideType t;
+      if (!is_big && exp <= kMaxExp && !MulOverflow(value, Pow10(exp), &t)) {
+        value = t;
+        return;
+      }
+      ToDigits();
+      if (!digits.empty()) {
+        digits.insert(0, exp, '0');
+      }
+    }
+
+    bool FitsInt64() const {
+      return !is_big && value <= std::numeric_limits<int64_t>::max();
+    }
+
+    void AppendTo(OutputSink& sink) {
+      ToDigits();
+      if (digits.empty()) {
+        sink.Append('0');
+      }
+      std::for_each(digits.rbegin(), digits.rend(), [&](char d) { sink.Append(d); });
+    }
+
+    void ToDigits() {
+      if (is_big) {
+        return;
+      }
+      digits.clear();
+      for (; value > 0; value /= 10) {
+        digits += '0' + int(value % 10);
+      }
+      is_big = true;
+    }
+
+    static WideType Pow10(int exp) {
+      static constexpr auto kPow10 = [] {
+        std::array<WideType, kMaxExp + 1> pow{ 1 };
+        for (int i = 1; i <= kMaxExp; i++) {
+          pow[i] = pow[i - 1] * 10;
+        }
+        return pow;
+      }();
+      return kPow10[exp];
+    }
+
+    static bool MulOverflow(WideType a, WideType b, WideType* r) {
+#if defined(__GNUC__) || defined(__clang__)
+      return __builtin_mul_overflow(a, b, r);
+#else
+      if (a != 0 && b > std::numeric_limits<WideType>::max() / a) return true;
+      *r = a * b;
+      return false;
+#endif
+    }
+
+    static bool AddOverflow(WideType a, WideType b, WideType* r) {
+#if defined(__GNUC__) || defined(__clang__)
+      return __builtin_add_overflow(a, b, r);
+#else
+      if (b > std::numeric_limits<WideType>::max() - a) return true;
+      *r = a + b;
+      return false;
+#endif
+    }
+  };
+
+  static constexpr bool kJapanese = L == Language::Japanese;
+
+  UTF8String  str_;
+  ParserEngine engine_;
+  enum : U8Char {
+    TOKEN_TYPE_EOF = ~((U8Char)0),
+  };
+  std::shared_ptr<const NumDict> own_dict_;   // if built for a Vocabulary
+  const NumDict& dict_;
+  Token       tokens_[UTF8String::kWindowSize];   // the last tokens lexed
+  size_t      lexed_          = 0;    // number of tokens lexed so far
+  size_t      next_char_      = 0;    // index in str_ of the char after them
+  size_t      peak_idx_       = -1;
+  size_t      peak_idx_rec_   = -1;
+  Token       lookahead_;
+  size_t      unit_factor_    = 1;
+  Token       neg_token_;
+  bool        has_out_        = false;
+  std::string out_;
+  OutputSink* sink_           = nullptr;  // where Start() writes
+  bool        has_error_      = false;
+  bool        last_is_num_    = false;
+  bool        negative_       = false;
+  size_t      stop_offset_    = std::string_view::npos;   // see StreamConvertor
+  std::vector<NumeralSpan> spans_;
+  ConversionStats stats_      = {};
+  WideAcc     wide_;
+  bool        is_wide_        = false;  // the last numeral is in wide_, see EndNumeral()
+  int         section_shift_  = 0;      // decimals of the section, see ArabicSection()
+  std::vector<SegmentBoundary>* boundaries_ = nullptr;   // see IncrementalConvertor
+  UTF8ErrorPolicy utf8_policy_ = UTF8ErrorPolicy::PassThrough;
+  UTF8Errors  utf8_errors_    = {};
+  std::string fixed_;                   // the input with U+FFFD, see CheckUTF8()
+  const PhraseLexicon* lexicon_ = nullptr;
+
+  friend class StreamConvertor;
+  friend class IncrementalConvertor;
+
+  // Reset() without checking the input, for the pieces of a text that
+  // StreamConvertor and IncrementalConvertor parse, which may cut a char
+  void Restart(std::string_view str) {
+    str_.Assign(str);
+    lexed_        = 0;
+    next_char_    = 0;
+    peak_idx_     = -1;
+    peak_idx_rec_ = -1;
+    unit_factor_  = 1;
+    has_out_      = false;
+    has_error_    = false;
+    last_is_num_  = false;
+    stop_offset_  = std::string_view::npos;
+    stats_        = {};
+    out_.clear();
+  }
+
+  // Count the invalid sequences of str, and replace them or give up on str
+  // as utf8_policy_ says. Valid text, the usual case, is only read once, at
+  // the speed of UTF8Validator.
+  void CheckUTF8(std::string_view str) {
+    utf8_errors_ = { 0, 0 };
+    size_t i = UTF8Validator::ValidPrefix(str.data(), str.size());
+    if (i == str.size()) {
+      return;
+    }
+    bool replace = utf8_policy_ == UTF8ErrorPolicy::Replace;
+    if (replace) {
+      fixed_.assign(str.data(), i);
+    }
+    while (i < str.size()) {
+      size_t bad, n = UTF8Validator::CharSize((const uint8_t*)str.data() + i, str.size() - i, &bad);
+      if (n > 0) {
+        if (replace) {
+          fixed_.append(str.data() + i, n);
+        }
+        i += n;
+        continue;
+      }
+      if (utf8_errors_.count++ == 0) {
+        utf8_errors_.first_offset = i;
+      }
+      if (utf8_policy_ == UTF8ErrorPolicy::Fail) {
+        str_.Assign(std::string_view());
+        return;
+      }
+      // The valid text that follows at full speed
+      i += bad;
+      n = UTF8Validator::ValidPrefix(str.data() + i, str.size() - i);
+      if (replace) {
+        fixed_.append("\xef\xbf\xbd");
+        fixed_.append(str.data() + i, n);
+      }
+      i += n;
+    }
+    if (replace) {
+      str_.Assign(fixed_);
+    }
+  }
+
+  static const NumDict& GetNumDict() {
+    // Function-local statics are initialized once, thread-safely, on first use.
+    static const NumDict dict = InitializeNumDict(L);
+    return dict;
+  }
+
+  static NumDict InitializeNumDict(Language lang, const Vocabulary* vocab = nullptr) {
+    NumDict dict;
+    dict.trie.emplace_back();
+    AddChars(dict, NumeralChars::kDigits[0], TC_DIGIT);
+    AddChars(dict, NumeralChars::kDigits[1], TC_DIGIT);
+    AddChars(dict, NumeralChars::kTwo, TC_DIGIT, 2); // Alias for 二
+    AddChars(dict, NumeralChars::kSmallUnits[0], TC_TEN, 1);
+    AddChars(dict, NumeralChars::kSmallUnits[1], TC_HUNDRED, 2);
+    AddChars(dict, NumeralChars::kSmallUnits[2], TC_THOUSAND, 3);
+    AddChars(dict, NumeralChars::kWan, TC_BIG_UNIT, 4);
+    AddChars(dict, NumeralChars::kJing, TC_BIG_UNIT, 16);
+    AddChars(dict, NumeralChars::kYi[int(lang)], TC_BIG_UNIT, 8);
+
+    dict.char_pt = UTF8String(NumeralChars::kPoint)[0];
+    dict.char_ne = UTF8String(NumeralChars::kNegative[int(lang)])[0];
+    dict.char_ne_jp_alt = 0x200001; // Pseudo token for Mai-Na-Su
+    if (lang == Language::Japanese) {
+        AddChars(dict, NumeralChars::kZhao, TC_BIG_UNIT, 12);
+        AddToken(dict, "ゼロ", { 1, { { 0x200000, { TC_DIGIT, 0, false } } } });
+        AddToken(dict, "マイナス", { 1, { { dict.char_ne_jp_alt, { TC_OTHER, 0, false } } } });
+    } else {
+        AddChars(dict, "零", TC_ZERO, 0);
+        AddChars(dict, NumeralChars::kZhao, TC_BIG_UNIT, 6);
+    }
+    AddChars(dict, "０１２３４５６７８９", TC_ARABIC_DIGIT);
+
+    // Chars that can start a numeral, or be part of one in case of ゼロ and
+    // マイナス. 点 only matters right after a numeral, which is never inside
+    // a passthrough run, so it does not have to stop the scanner.
+    dict.scanner.AddChars("零一二三四五六七八九壹贰叁肆伍陆柒捌玖两十拾百佰千仟万兆京");
+    if (lang == Language::Japanese) {
+        dict.scanner.AddChars("億負ゼマ");
+    } else {
+        dict.scanner.AddChars("亿负");
+    }
+    if (vocab) {
+        AddVocabulary(dict, *vocab);
+    }
+    return dict;
+  }
+
+  // The meanings are all read with the built-in vocabulary, before any token
+  // of vocab is added
+  static void AddVocabulary(NumDict& dict, const Vocabulary& vocab) {
+    std::vector<std::pair<const Vocabulary::Entry*, Expansion>> tokens;
+    for (auto& entry : vocab.Entries()) {
+      Expansion e;
+      if (ReadMeaning(dict, entry.meaning, &e)) {
+        tokens.emplace_back(&entry, e);
+      }
+    }
+    for (auto& [entry, e] : tokens) {
+      UTF8String token(entry->token);
+      if (!token.Has(1) && e.size == 1 && e.parts[0].cls.cls != TC_OTHER) {
+        // Read like the char it stands for, which is as fast as it gets
+        CharClass c = e.parts[0].cls;
+        c.word = dict.classes[token[0]].word;
+        dict.classes.Set(token[0], c);
+      } else {
+        AddToken(dict, entry->token.c_str(), e);
+      }
+      std::string_view first(entry->token);
+      dict.scanner.AddChars(std::string(first.substr(0, token.ByteEnd(0))).c_str());
+    }
+  }
+
+  // Lex meaning with the built-in vocabulary. Return false if one of its
+  // chars is not in it.
+  static bool ReadMeaning(const NumDict& dict, std::string_view meaning, Expansion* e) {
+    UTF8String str(meaning);
+    e->size = 0;
+    for (size_t i = 0; str.Has(i); i++) {
+      // The longest built-in word at i, if any
+      size_t length = 0;
+      uint32_t node = 0;
+      for (size_t k = 0; str.Has(i + k) && (node = dict.Child(node, str[i + k])) != 0; k++) {
+        if (dict.trie[node].expansion >= 0) {
+          *e = dict.expansions[dict.trie[node].expansion];
+          length = k + 1;
+        }
+      }
+      if (length > 0) {
+        if (i > 0 || str.Has(length)) {
+          return false;   // a word is only allowed alone
+        }
+        return true;
+      }
+      CharClass c = dict.classes[str[i]];
+      c.word = 0;
+      if ((c.cls == TC_OTHER && str[i] != dict.char_ne && str[i] != dict.char_pt) || c.cls >= TC_ARABIC) {
+        return false;
+      }
+      e->parts[e->size++] = { str[i], c };
+    }
+    return e->size > 0;
+  }
+
+  // Give every char of str the class cls and the value num, or if num is
+  // negative, its index in str
+  static void AddChars(NumDict& dict, const char* str, TokenClass cls, int num = -1) {
+    UTF8String u8str(str);
+    for (int i=0; u8str.Has(i); i++) {
+      dict.classes.Set(u8str[i], { cls, int8_t(num < 0 ? i : num), dict.classes[u8str[i]].word });
+    }
+  }
+
+  // Add a token of one or more chars to the trie, the first of them being a
+  // 3-byte char. The token replaces any previous one with the same chars.
+  static void AddToken(NumDict& dict, const char* str, const Expansion& e) {
+    UTF8String u8str(str);
+    uint32_t node = 0;
+    for (int i=0; u8str.Has(i); i++) {
+      uint32_t child = dict.Child(node, u8str[i]);
+      if (child == 0) {
+        child = dict.trie.size();
+        if (node == 0) {
+          CharClass first = dict.classes[u8str[i]];
+          first.word = child;
+          dict.classes.Set(u8str[i], first);
+        } else {
+          dict.trie[node].next.emplace_back(u8str[i], child);
+        }
+        dict.trie.emplace_back();
+      }
+      node = child;
+    }
+    if (dict.trie[node].expansion < 0) {
+      dict.trie[node].expansion = dict.expansions.size();
+      dict.expansions.push_back(e);
+    } else {
+      dict.expansions[dict.trie[node].expansion] = e;
+    }
+  }
+
+
+  // Read the token starting at the char next_char_. Only the chars that may
+  // start a token of the trie are looked up in it, so it costs nothing to the
+  // other chars.
+  void Lex() {
+    uint32_t ch = str_[next_char_];
+    CharClass c = dict_.classes[ch];
+    if (c.word != 0 && LexTrieToken(c.word)) {
+      return;
+    }
+    if (c.cls == TC_ARABIC_DIGIT || (c.cls == TC_OTHER && IsAsciiDigit(ch))) {
+      LexArabic();
+      return;
+    }
+    Token& t = tokens_[lexed_ % UTF8String::kWindowSize];
+    t.value = ch;
+    t.begin = str_.ByteOffset(next_char_);
+    t.end = str_.ByteEnd(next_char_);
+    t.cls = c.cls;
+    t.num = c.num;
+    next_char_++;
+    lexed_++;
+  }
+
+  // Lex the longest token of the trie at the char next_char_, which leads to
+  // node, as the tokens of its meaning. They all start where it does, and all
+  // but the last are empty, so that the text of the token is copied once if
+  // it is not part of a numeral. Return false if no token of the trie is there.
+  bool LexTrieToken(uint32_t node) {
+    int32_t expansion = dict_.trie[node].expansion;
+    size_t length = 1;
+    for (size_t i = 1; i < Vocabulary::kMaxTokenChars && str_.Has(next_char_ + i); i++) {
+      node = dict_.Child(node, str_[next_char_ + i]);
+      if (node == 0) {
+        break;
+      }
+      if (dict_.trie[node].expansion >= 0) {
+        expansion = dict_.trie[node].expansion;
+        length = i + 1;
+      }
+    }
+    if (expansion < 0) {
+      return false;
+    }
+    const Expansion& e = dict_.expansions[expansion];
+    size_t begin = str_.ByteOffset(next_char_);
+    size_t end = str_.ByteEnd(next_char_ + length - 1);
+    for (size_t k = 0; k < e.size; k++) {
+      Token& t = tokens_[lexed_ % UTF8String::kWindowSize];
+      t = { e.parts[k].value, begin, k + 1 < e.size ? begin : end, e.parts[k].cls.cls, e.parts[k].cls.num };
+      lexed_++;
+    }
+    next_char_ += length;
+    return true;
+  }
+
+  // Lex the run of ASCII or full-width digits at the char next_char_, with a
+  // decimal part if any, as one token, whose class depends on what follows.
+  // Before a unit that leaves it a whole number, it is a single TC_DIGIT, or
+  // TC_ARABIC with the number of decimals as num. Otherwise a single digit
+  // is TC_ARABIC_DIGIT and an integer TC_ARABIC_SECTION with its number of
+  // digits as num, which only continue a numeral, so that 2023 or １２ alone
+  // are left as they are. Longer runs, the rest, runs right after a letter
+  // as in MP3, groups of a number such as 1,000 and runs with leading zeros
+  // are TC_OTHER.
+  void LexArabic() {
+    std::string_view s = str_.View();
+    size_t begin = str_.ByteOffset(next_char_), end = begin, n;
+    int digits = 0, decimals = -1;
+    while (true) {
+      if ((n = ArabicDigitSize(s, end)) > 0) {
+        digits++;
+        decimals += decimals >= 0;
+        end += n;
+      } else if (decimals < 0 && (n = ArabicPointSize(s, end)) > 0 && ArabicDigitSize(s, end + n) > 0) {
+        decimals = 0;
+        end += n;
+      } else {
+        break;
+      }
+    }
+    Token& t = tokens_[lexed_ % UTF8String::kWindowSize];
+    t = { str_[next_char_], begin, end, TC_OTHER, 0 };
+    str_.Skip(next_char_, end);
+    next_char_++;
+    lexed_++;
+    // Decode the chars that were looked at, so that IncrementalConvertor
+    // knows the token depends on them
+    if (str_.Has(next_char_) && ArabicPointSize(s, end) > 0) {
+      str_.Has(next_char_ + 1);
+    }
+    if (str_.Has(next_char_) && s[end] == ',') {
+      str_.Has(next_char_ + 1);
+    }
+    bool leading_zero = digits - std::max(decimals, 0) > 1 && ArabicDigitValue(s, begin) == 0;
+    if (digits > int(kMaxArabicDigits) || IsWordDigit(begin) || IsGroupedDigits(begin, end) || leading_zero) {
+      return;
+    }
+    // Units that start a token of the trie are not sure to be read as units
+    CharClass unit = str_.Has(next_char_) ? dict_.classes[str_[next_char_]] : CharClass{ TC_OTHER, 0, 0 };
+    bool before_unit = unit.word == 0 && unit.cls >= TC_TEN && unit.cls <= TC_BIG_UNIT &&
+                       decimals < unit.num + (unit.cls != TC_BIG_UNIT);
+    if (before_unit) {
+      t.cls = digits == 1 ? TC_DIGIT : TC_ARABIC;
+      t.num = digits == 1 ? ArabicDigitValue(s, begin) : std::max(decimals, 0);
+    } else if (decimals < 0) {
+      t.cls = digits == 1 ? TC_ARABIC_DIGIT : TC_ARABIC_SECTION;
+      t.num = digits == 1 ? ArabicDigitValue(s, begin) : digits;
+    }
+  }
+
+  // Value of a TC_ARABIC or TC_ARABIC_SECTION token, without its decimal
+  // point. The third byte of a full-width digit is 0x90 to 0x99, and no
+  // other byte of a run is.
+  NumberType ArabicValue(const Token& token) const {
+    NumberType n = 0;
+    for (size_t i = token.begin; i < token.end; i++) {
+      uint8_t b = str_.View()[i];
+      if (b >= '0' && b <= '9') {
+        n = n * 10 + (b - '0');
+      } else if (b >= 0x90 && b <= 0x99) {
+        n = n * 10 + (b - 0x90);
+      }
+    }
+    return n;
+  }
+
+  // Size of the ASCII or full-width digit at byte i of s, or 0
+  static size_t ArabicDigitSize(std::string_view s, size_t i) {
+    if (i < s.size() && s[i] >= '0' && s[i] <= '9') {
+      return 1;
+    }
+    if (i + 2 < s.size() && (uint8_t)s[i] == 0xef && (uint8_t)s[i + 1] == 0xbc &&
+        (uint8_t)s[i + 2] >= 0x90 && (uint8_t)s[i + 2] <= 0x99) {
+      return 3;
+    }
+    return 0;
+  }
+
+  static int ArabicDigitValue(std::string_view s, size_t i) {
+    return s[i] >= '0' && s[i] <= '9' ? s[i] - '0' : (uint8_t)s[i + 2] - 0x90;
+  }
+
+  // Size of the ASCII or full-width decimal point at byte i of s, or 0
+  static size_t ArabicPointSize(std::string_view s, size_t i) {
+    if (i < s.size() && s[i] == '.') {
+      return 1;
+    }
+    if (i + 2 < s.size() && (uint8_t)s[i] == 0xef && (uint8_t)s[i + 1] == 0xbc && (uint8_t)s[i + 2] == 0x8e) {
+      return 3;
+    }
+    return 0;
+  }
+
+  // Size of the digit that ends at byte i of s and starts at from or after,
+  // or 0
+  static size_t ArabicDigitBefore(std::string_view s, size_t from, size_t i) {
+    if (i > from && ArabicDigitSize(s, i - 1) == 1) {
+      return 1;
+    }
+    return i >= from + 3 && ArabicDigitSize(s, i - 3) == 3 ? 3 : 0;
+  }
+
+  // Whether a byte may be the last one of a digit or of a decimal point
+  static bool MayEndArabicRun(uint8_t b) {
+    return (b >= '0' && b <= '9') || (b >= 0x90 && b <= 0x99) || b == '.' || b == 0x8e;
+  }
+
+  // Start of the run of digits that ends at byte i of s, with the points
+  // between two of them, as LexArabic() reads it from there. The run starts
+  // at from or after.
+  static size_t ArabicRunStart(std::string_view s, size_t from, size_t i) {
+    while (true) {
+      size_t n = ArabicDigitBefore(s, from, i);
+      for (size_t p : { 1, 3 }) {
+        if (n == 0 && ArabicDigitSize(s, i) > 0 && i >= from + p && ArabicPointSize(s, i - p) == p &&
+            ArabicDigitBefore(s, from, i - p) > 0) {
+          n = p;
+        }
+      }
+      if (n == 0) {
+        return i;
+      }
+      i -= n;
+    }
+  }
+
+  static bool IsAsciiDigit(uint32_t ch) {
+#if SISI_ENABLE_LITTLE_ENDIAN
+    return ch - '0' < 10;
+#else
+    return ch - ((uint32_t)'0' << 24) < (10u << 24);
+#endif
+  }
+
+  // Whether the digit at byte i is part of a word, as in MP3 or v1.2
+  bool IsWordDigit(size_t i) const {
+    std::string_view s = str_.View();
+    if (i == 0 || ArabicDigitSize(s, i) == 0) {
+      return false;
+    }
+    char b = s[i - 1];
+    return (b >= 'a' && b <= 'z') || (b >= 'A' && b <= 'Z') || b == '_' || b == '.';
+  }
+
+  // Whether the run of digits from byte begin to end is a group of a number
+  // written with separators, as in 1,000
+  bool IsGroupedDigits(size_t begin, size_t end) const {
+    std::string_view s = str_.View();
+    return (begin > 0 && s[begin - 1] == ',' && ArabicDigitBefore(s, 0, begin - 1) > 0) ||
+           (end < s.size() && s[end] == ',' && ArabicDigitSize(s, end + 1) > 0);
+  }
+
+  // Make the token at peak_idx_ the lookahead, lexing it if needed. Tokens
+  // are kept for a while, so stepping back is free.
+  U8Char Load() {
+    while (lexed_ <= peak_idx_ && str_.Has(next_char_)) {
+      Lex();
+    }
+    if (peak_idx_ < lexed_) {
+      lookahead_ = tokens_[peak_idx_ % UTF8String::kWindowSize];
+    } else {
+      SISI_LOGD("Next EOF. idx=%zu", peak_idx_);
+      lookahead_ = { TOKEN_TYPE_EOF, str_.ByteSize(), str_.ByteSize(), TC_OTHER, 0 };
+    }
+    return lookahead_.value;
+  }
+
+  U8Char Next() {
+    peak_idx_++;
+    return Load();
+  }
+
+  U8Char Retract() {
+    SISI_STAT(stats_.retracts++);
+    peak_idx_--;
+    return Load();
+  }
+
+  // The token after the lookahead, lexed if needed without moving to it. A
+  // run of digits before a unit is always followed by one.
+  const Token& Peek() {
+    while (lexed_ <= peak_idx_ + 1 && str_.Has(next_char_)) {
+      Lex();
+    }
+    return tokens_[(peak_idx_ + 1) % UTF8String::kWindowSize];
+  }
+
+  void SavePos() {
+    peak_idx_rec_ = peak_idx_;
+  }
+
+  void RestorePos() {
+    SISI_STAT(stats_.restores++);
+    peak_idx_ = peak_idx_rec_;
+    Load();
+  }
+
+#define SISI_IS_FIRST_O() (CLASS == TC_DIGIT || CLASS == TC_ZERO || CLASS == TC_TEN || CLASS == TC_ARABIC || (kJapanese && (CLASS == TC_HUNDRED || CLASS == TC_THOUSAND)))
+#define SISI_IS_FIRST_NE() (SISI_IS_FIRST_O() || LOOKAHEAD == dict_.char_ne || (kJapanese && LOOKAHEAD == dict_.char_ne_jp_alt))
+
+#define LOOKAHEAD (lookahead_.value)
+#define CLASS (lookahead_.cls)
+
+
+#define SISI_RETURN(x) return (x)
+
+  NumberType N() {
+    if (CLASS == TC_DIGIT || CLASS == TC_ZERO || CLASS == TC_ARABIC_DIGIT) {
+      NumberType n = lookahead_.num;
+      Next(); SISI_RETURN(n);
+    }
+    SISI_RETURN(-1);
+  }
+
+  NumberType J() {
+    NumberType n = N();
+    if (CLASS == TC_TEN) {
+      Next(); unit_factor_ = 10;
+      NumberType m = N();
+      SISI_RETURN(std::max<NumberType>(1, n) * 10 + std::max<NumberType>(0, m));
+    }
+    SISI_RETURN(std::max<NumberType>(0, n));
+  }
+
+  NumberType H() {
+    NumberType n = N(), m;
+    if (CLASS == TC_HUNDRED) {
+      Next();
+      unit_factor_ = 100;
+      if (!kJapanese && CLASS == TC_ZERO) {
+        unit_factor_ = 10; Next(); m = N();
+      }
+      else { m = J(); }
+      SISI_RETURN(std::max<NumberType>(1, n) * NumberType(100) + std::max<NumberType>(0, m));
+    }
+    if (n >= 0) { Retract(); }
+    SISI_RETURN(J());
+  }
+
+  NumberType S() {
+    if (CLASS == TC_ARABIC || CLASS == TC_ARABIC_SECTION) {
+      SISI_RETURN(ArabicSection());
+    }
+    NumberType n = N(), m;
+    if (CLASS == TC_THOUSAND) {
+      Next();
+      unit_factor_ = 1000;
+      if (!kJapanese && CLASS == TC_ZERO) {
+        unit_factor_ = 10; Next(); m = J();
+      }
+      else { m = H(); }
+      SISI_RETURN(std::max<NumberType>(1, n) * NumberType(1000) + std::max<NumberType>(0, m));
+    }
+    if (n >= 0) { Retract(); }
+    SISI_RETURN(H());
+  }
+
+  // Kei, Chou, Oku and Man: sections delimited by units from 万 up
+  NumberType O() {
+    NumberType n = S();
+    if (CLASS != TC_BIG_UNIT) {
+      SISI_RETURN(ImpliedUnit(n));
+    }
+    while (BigUnit(n, lookahead_.num)) {
+      if (!kJapanese && CLASS == TC_ZERO) { unit_factor_ = 10; Next(); }
+      n = S();
+      if (CLASS != TC_BIG_UNIT) {
+        break;
+      }
+    }
+    SISI_RETURN(EndNumeral(n));
+  }
+
+  // Read a run of digits as a whole section, with the small unit following
+  // it if any. Before a unit from 万 up, the section is returned scaled by
+  // 10^decimals, which BigUnit() takes back from the unit, as in 1.5亿. A
+  // TC_ARABIC_SECTION with more digits than the last unit leaves room for,
+  // as in 3万50000, or a run with decimals that the unit after it cannot
+  // take, is not read, and 0 is returned. The unit is looked at with Peek(),
+  // so that neither engine has to step back over the run.
+  NumberType ArabicSection() {
+    NumberType n = ArabicValue(lookahead_);
+    if (CLASS == TC_ARABIC_SECTION) {
+      if (lookahead_.num > wide_.last_exp) {
+        SISI_RETURN(0);
+      }
+      Next();
+      unit_factor_ = 10;    // no unit is implied, as in 3万5001
+      SISI_RETURN(n);
+    }
+    int decimals = lookahead_.num;
+    const Token& unit = Peek();
+    if (unit.cls == TC_BIG_UNIT) {
+      WideType group;
+      if (wide_.Fit(n, unit.num - decimals, false, &group) == WideAcc::kNoFit) {
+        SISI_RETURN(0);
+      }
+      Next();
+      section_shift_ = decimals;
+      SISI_RETURN(n);
+    }
+    Next();
+    n *= NumberType(WideAcc::Pow10(lookahead_.num - decimals));
+    Next();
+    unit_factor_ = 10;
+    SISI_RETURN(n);
+  }
+
+  // Read the unit 10^exp of the lookahead following section, unless it cannot
+  // follow the units read so far. A section with decimals always can, see
+  // ArabicSection().
+  bool BigUnit(NumberType section, int exp) {
+    int shift = section_shift_;
+    section_shift_ = 0;
+    if (!wide_.Push(section, exp - shift, peak_idx_ == wide_.unit_end)) {
+      return false;
+    }
+    Next();
+    // Only whether it is 万 matters, see ImpliedUnit()
+    unit_factor_ = exp == 4 ? 10000 : 100000000;
+    wide_.unit_end = peak_idx_;
+    return true;
+  }
+
+  // Add the last section. If the value does not fit in NumberType, it is
+  // left in wide_ and the maximum is returned.
+  NumberType EndNumeral(NumberType section) {
+    wide_.Finish(ImpliedUnit(section));
+    if (wide_.FitsInt64()) {
+      return NumberType(wide_.value);
+    }
+    is_wide_ = true;
+    return std::numeric_limits<NumberType>::max();
+  }
+
+  NumberType ImpliedUnit(NumberType section) {
+    if (!kJapanese && unit_factor_ > 10 && unit_factor_ <= 10000) {
+      // In oral Chinese, only tailing number less than 10 thousand can omit
+      // the tailing numeric unit (千, 百, 十)
+      auto tail_num = section % 10;
+      section = section - tail_num + tail_num * unit_factor_ / 10;
+    }
+    return section;
+  }
+
+  /*
+     The state machine engine, compiled from the same grammar. A numeral is a
+     sequence of sections (Sen), delimited by units from 万 up as in
+     "Sen 万 Sen 亿 Sen 万 Sen", see WideAcc. Within a section, the transition
+     table tells for the current state and the class of the lookahead token
+     what to do. A digit is kept pending until the next token tells whether it
+     multiplies a unit or ends the section, so the parser never has to step
+     back.
+   */
+
+  enum AutomatonState : uint8_t {
+    AS_SEN,               // Sen: start of a section
+    AS_SEN_DIGIT,         // Sen: a digit is pending
+    AS_AFTER_THOUSAND,    // after 千
+    AS_HYAKU,             // Hyaku
+    AS_HYAKU_DIGIT,
+    AS_AFTER_HUNDRED,     // after 百
+    AS_JUU,               // Juu
+    AS_JUU_DIGIT,
+    AS_NUM,               // Num: an optional final digit
+    AS_AFTER_BIG_UNIT,    // after 万, 亿...
+    AS_SECTION_END,
+    AS_COUNT,
+  };
+
+  enum AutomatonAction : uint8_t {
+    AA_END,               // end of section, the token is not consumed
+    AA_DIGIT,             // keep the digit pending
+    AA_UNIT,              // multiply the pending digit (or 1) by the unit
+    AA_ZERO,              // skip 零
+    AA_LAST_DIGIT,        // add the digit and end the section
+    AA_ARABIC,            // read a run of digits as the section, see ArabicSection()
+  };
+
+  struct Transition {
+    AutomatonState  next;
+    AutomatonAction action;
+  };
+
+#define SISI_T(state, action) { AS_##state, AA_##action }
+#define SISI_END SISI_T(SECTION_END, END)
+  //                          OTHER      DIGIT                             ZERO                              TEN                 HUNDRED                       THOUSAND                       BIG_UNIT   ARABIC                        ARABIC_DIGIT                      ARABIC_SECTION
+  static constexpr Transition kTransitions[AS_COUNT][TC_COUNT] = {
+    /* AS_SEN            */ { SISI_END,  SISI_T(SEN_DIGIT, DIGIT),         SISI_T(SEN_DIGIT, DIGIT),         SISI_T(NUM, UNIT),  SISI_T(AFTER_HUNDRED, UNIT),  SISI_T(AFTER_THOUSAND, UNIT),  SISI_END,  SISI_T(SECTION_END, ARABIC),  SISI_T(SEN_DIGIT, DIGIT),         SISI_T(SECTION_END, ARABIC) },
+    /* AS_SEN_DIGIT      */ { SISI_END,  SISI_END,                         SISI_END,                         SISI_T(NUM, UNIT),  SISI_T(AFTER_HUNDRED, UNIT),  SISI_T(AFTER_THOUSAND, UNIT),  SISI_END,  SISI_END,                     SISI_END,                         SISI_END },
+    /* AS_AFTER_THOUSAND */ { SISI_END,  SISI_T(HYAKU_DIGIT, DIGIT),       SISI_T(JUU, ZERO),                SISI_T(NUM, UNIT),  SISI_T(AFTER_HUNDRED, UNIT),  SISI_END,                      SISI_END,  SISI_END,                     SISI_T(HYAKU_DIGIT, DIGIT),       SISI_END },
+    /* AS_HYAKU          */ { SISI_END,  SISI_T(HYAKU_DIGIT, DIGIT),       SISI_T(HYAKU_DIGIT, DIGIT),       SISI_T(NUM, UNIT),  SISI_T(AFTER_HUNDRED, UNIT),  SISI_END,                      SISI_END,  SISI_END,                     SISI_T(HYAKU_DIGIT, DIGIT),       SISI_END },
+    /* AS_HYAKU_DIGIT    */ { SISI_END,  SISI_END,                         SISI_END,                         SISI_T(NUM, UNIT),  SISI_T(AFTER_HUNDRED, UNIT),  SISI_END,                      SISI_END,  SISI_END,                     SISI_END,                         SISI_END },
+    /* AS_AFTER_HUNDRED  */ { SISI_END,  SISI_T(JUU_DIGIT, DIGIT),         SISI_T(NUM, ZERO),                SISI_T(NUM, UNIT),  SISI_END,                     SISI_END,                      SISI_END,  SISI_END,                     SISI_T(JUU_DIGIT, DIGIT),         SISI_END },
+    /* AS_JUU            */ { SISI_END,  SISI_T(JUU_DIGIT, DIGIT),         SISI_T(JUU_DIGIT, DIGIT),         SISI_T(NUM, UNIT),  SISI_END,                     SISI_END,                      SISI_END,  SISI_END,                     SISI_T(JUU_DIGIT, DIGIT),         SISI_END },
+    /* AS_JUU_DIGIT      */ { SISI_END,  SISI_END,                         SISI_END,                         SISI_T(NUM, UNIT),  SISI_END,                     SISI_END,                      SISI_END,  SISI_END,                     SISI_END,                         SISI_END },
+    /* AS_NUM            */ { SISI_END,  SISI_T(SECTION_END, LAST_DIGIT),  SISI_T(SECTION_END, LAST_DIGIT),  SISI_END,           SISI_END,                     SISI_END,                      SISI_END,  SISI_END,                     SISI_T(SECTION_END, LAST_DIGIT),  SISI_END },
+    /* AS_AFTER_BIG_UNIT */ { SISI_END,  SISI_T(SEN_DIGIT, DIGIT),         SISI_T(SEN, ZERO),                SISI_T(NUM, UNIT),  SISI_T(AFTER_HUNDRED, UNIT),  SISI_T(AFTER_THOUSAND, UNIT),  SISI_END,  SISI_T(SECTION_END, ARABIC),  SISI_T(SEN_DIGIT, DIGIT),         SISI_T(SECTION_END, ARABIC) },
+    /* AS_SECTION_END    */ { SISI_END,  SISI_END,                         SISI_END,                         SISI_END,           SISI_END,                     SISI_END,                      SISI_END,  SISI_END,                     SISI_END,                         SISI_END },  // see Automaton()
+  };
+#undef SISI_END
+#undef SISI_T
+
+  static constexpr NumberType kUnitValue[TC_COUNT] = { 0, 0, 0, 10, 100, 1000, 0, 0, 0, 0 };
+
+  NumberType Automaton() {
+    NumberType section = 0, pending = -1;
+    AutomatonState state = AS_SEN;
+    while (true) {
+      TokenClass tc = CLASS;
+      int value = lookahead_.num;
+      if (state == AS_SECTION_END) {
+        // Only a unit from 万 up can continue a numeral after a complete section
+        if (tc != TC_BIG_UNIT || !BigUnit(section, value)) {
+          break;
+        }
+        section = 0;
+        state = AS_AFTER_BIG_UNIT;
+        continue;
+      }
+      const Transition& t = kTransitions[state][tc];
+      switch (t.action) {
+        case AA_END:
+          section += std::max<NumberType>(0, pending);
+          pending = -1;
+          break;
+        case AA_DIGIT:
+          pending = value;
+          Next();
+          break;
+        case AA_UNIT:
+          section += std::max<NumberType>(1, pending) * kUnitValue[tc];
+          pending = -1;
+          unit_factor_ = kUnitValue[tc];
+          Next();
+          break;
+        case AA_ZERO:
+          unit_factor_ = 10;
+          Next();
+          break;
+        case AA_LAST_DIGIT:
+          section += value;
+          Next();
+          break;
+        case AA_ARABIC:
+          section = ArabicSection();
+          break;
+      }
+      state = t.next;
+    }
+    SISI_RETURN(EndNumeral(section));
+  }
+
+  NumberType NE() {
+    int factor = 1;
+    negative_ = false;
+    if (LOOKAHEAD == dict_.char_ne || (kJapanese && LOOKAHEAD == dict_.char_ne_jp_alt)) {
+      neg_token_ = lookahead_;
+      negative_ = true;
+      Next(); factor = -1;
+    }
+    if (!SISI_IS_FIRST_O()) {
+      has_error_ = true;
+      SISI_RETURN(0);
+    }
+    NumberType n = engine_ == ParserEngine::StateMachine ? Automaton() : O();
+    // A value too large for NumberType is clamped to the limit of its sign
+    if (is_wide_ && factor < 0) {
+      SISI_RETURN(std::numeric_limits<NumberType>::min());
+    }
+    SISI_RETURN(factor * n);
+  }
+
+  NumberType ParseNumber() {
+    unit_factor_ = 1;
+    has_error_ = false;
+    is_wide_ = false;
+    section_shift_ = 0;
+    wide_.Clear();
+    return NE();
+  }
+
+  // Copy the source text of a token
+  void AppendToken(const Token& token) {
+    sink_->Append(str_.View().data() + token.begin, token.end - token.begin);
+  }
+
+  // Whether the lookahead, right after a numeral, is a run of digits that
+  // could not join it
+  bool RunsIntoDigits() {
+    return LOOKAHEAD != TOKEN_TYPE_EOF && ArabicDigitSize(str_.View(), TokenOffset()) > 0;
+  }
+
+  // Byte offset where the lookahead token starts
+  size_t TokenOffset() {
+    return lookahead_.begin;
+  }
+
+  // Skip the phrase of lexicon_ starting at the lookahead, if any, and the
+  // rest of a token that it ends in, and copy them to the output unless
+  // only extracting
+  bool SkipPhrase() {
+    size_t begin = TokenOffset();
+    size_t end = lexicon_->Match(str_.View(), begin);
+    if (end == begin) {
+      return false;
+    }
+    while (LOOKAHEAD != TOKEN_TYPE_EOF && TokenOffset() < end) {
+      Next();
+    }
+    if (sink_) {
+      sink_->Append(str_.View().data() + begin, TokenOffset() - begin);
+    }
+    return true;
+  }
+
+  // Skip the text following the current token up to where the next numeral
+  // could start, without going through the parser char by char, and copy it
+  // to the output unless only extracting. Nothing is skipped if tokens were
+  // already lexed past the current one.
+  void SkipPassthrough(bool copy = true) {
+    if (lexed_ != peak_idx_ + 1) {
+      return;
+    }
+    std::string_view s = str_.View();
+    size_t from = lookahead_.end;
+    size_t end = std::min(s.size(), stop_offset_);
+    if (from >= end) {
+      return;
+    }
+    if (boundaries_ && end - from > kMaxSegmentSize) {
+      // Cut long runs into several segments
+      end = from + kMaxSegmentSize;
+    }
+    // The cut, or the stop offset, is moved back to the start of a UTF-8 char
+    while (end < s.size() && ((uint8_t)s[end] & 0xc0) == 0x80) {
+      end--;
+    }
+    size_t to = from + dict_.scanner.Find(s.data() + from, end - from);
+    // Digits are not triggers, as they are mostly left as they are, but a
+    // run of them may be read with the unit it stops at, or be cut by end.
+    // It is not skipped then.
+    if (to > from && to < s.size() && MayEndArabicRun((uint8_t)s[to - 1])) {
+      to = ArabicRunStart(s, from, to);
+    }
+    if (to > from) {
+      if (copy) {
+        sink_->Append(s.data() + from, to - from);
+      }
+      SISI_STAT(stats_.skipped_bytes += to - from);
+      str_.Skip(next_char_ - 1, to);
+    }
+  }
+
+  const std::string& Start() {
+    has_out_ = false;
+    out_.clear();
+    OutputSink sink(&out_);
+    Start(sink);
+    has_out_ = true;
+    return out_;
+  }
+
+  void Start(OutputSink& sink) {
+    SISI_STAT(auto start_time = std::chrono::steady_clock::now());
+    SISI_STAT(size_t start_size = sink.size());
+    sink_ = &sink;
+    sink.Reserve(std::min(str_.ByteSize(), stop_offset_));
+    Next();
+    bool& last_is_num = last_is_num_;
+    while (LOOKAHEAD != TOKEN_TYPE_EOF) {
+      // The digits of a word would be read as a numeral without the letter
+      // before them, so the parse cannot stop and start over there
+      if ((boundaries_ || stop_offset_ != std::string_view::npos) && !IsWordDigit(TokenOffset())) {
+        if (boundaries_) {
+          boundaries_->push_back({ TokenOffset(), sink.size(), str_.Frontier(), last_is_num });
+        }
+        if (TokenOffset() >= stop_offset_) {
+          break;
+        }
+      }
+      SISI_LOGD("Start loop: idx=%zu val=%lx first_ne=%d", peak_idx_, (uint64_t)LOOKAHEAD, SISI_IS_FIRST_NE());
+      if (SISI_IS_FIRST_NE()) {
+        if (lexicon_ && SkipPhrase()) {
+          last_is_num = false;
+          continue;
+        }
+        size_t begin = TokenOffset();
+        SavePos();
+        NumberType num = ParseNumber();
+        if (!has_error_ && RunsIntoDigits()) {
+          // The digits could not join the numeral, as in 3万50000, and would
+          // be glued to its value: leave both as they are
+          SISI_STAT(stats_.parse_errors++);
+          sink.Append(str_.View().data() + begin, TokenOffset() - begin);
+          AppendToken(lookahead_);
+          last_is_num = false;
+          Next();
+          continue;
+        }
+        if (has_error_) {
+          SISI_LOGD("Start loop: ParseNumber error");
+          SISI_STAT(stats_.parse_errors++);
+          if (engine_ == ParserEngine::StateMachine) {
+            // Nothing to undo, the token following the negative sign is
+            // already the lookahead
+            AppendToken(neg_token_);
+            continue;
+          }
+          RestorePos();
+          AppendToken(lookahead_);
+          Next();
+          continue;
+        }
+        SISI_LOGD("Start loop: Parsed num %ld", (long)num);
+        SISI_STAT(stats_.numerals++);
+        // Do not add space for single number, Typically for phone numbers, years
+        if (last_is_num && num > 10) {
+          sink.Append(' ');
+        }
+        if (is_wide_) {
+          if (negative_) {
+            sink.Append('-');
+          }
+          wide_.AppendTo(sink);
+        } else {
+          sink.AppendNumber(num);
+        }
+        last_is_num = true;
+      } else {
+        SISI_LOGD("Start loop: ELSE block");
+        if (LOOKAHEAD == dict_.char_pt && last_is_num) {
+          sink.Append('.');
+        } else {
+          AppendToken(lookahead_);
+        }
+        last_is_num = false;
+        SkipPassthrough();
+        Next();
+      }
+    }
+    if (boundaries_ && LOOKAHEAD == TOKEN_TYPE_EOF) {
+      boundaries_->push_back({ str_.ByteSize(), sink.size(), str_.ByteSize() + 1, last_is_num });
+    }
+    sink.Flush();
+    sink_ = nullptr;
+    SISI_STAT(stats_.output_bytes += sink.size() - start_size);
+    SISI_STAT(EndStats(start_time));
+  }
+
+  const std::vector<NumeralSpan>& StartExtract() {
+    SISI_STAT(auto start_time = std::chrono::steady_clock::now());
+    spans_.clear();
+    Next();
+    while (LOOKAHEAD != TOKEN_TYPE_EOF) {
+      if (!SISI_IS_FIRST_NE()) {
+        SkipPassthrough(false);
+        Next();
+        continue;
+      }
+      if (lexicon_ && SkipPhrase()) {
+        continue;
+      }
+      size_t begin = TokenOffset();
+      SavePos();
+      NumberType num = ParseNumber();
+      if (has_error_) {
+        SISI_STAT(stats_.parse_errors++);
+        if (engine_ == ParserEngine::RecursiveDescent) {
+          RestorePos();
+          Next();
+        }
+        continue;
+      }
+      if (RunsIntoDigits()) {
+        SISI_STAT(stats_.parse_errors++);
+        Next();
+        continue;
+      }
+      NumeralSpan span{ begin, TokenOffset(), num, negative_, false, is_wide_,
+                        unit_factor_ > 1 ? NumeralKind::Number : NumeralKind::Digit };
+      if (LOOKAHEAD == dict_.char_pt) {
+        Next();
+        // The numerals right after 点 are the fractional part
+        while (SISI_IS_FIRST_O()) {
+          ParseNumber();
+          span.has_decimal = true;
+          span.byte_end = TokenOffset();
+        }
+      }
+      spans_.push_back(span);
+    }
+    SISI_STAT(stats_.numerals = spans_.size());
+    SISI_STAT(EndStats(start_time));
+    return spans_;
+  }
+
+#if SISI_ENABLE_STATS
+  void EndStats(std::chrono::steady_clock::time_point start_time) {
+    stats_.codepoints += next_char_;
+    stats_.elapsed_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start_time).count();
+  }
+#endif
+};
+
+// Converts numerals of a language chosen at run time
+class ChineseNumberConvertor {
+public:
+  // The input is borrowed, not copied, and must outlive the convertor
+  explicit ChineseNumberConvertor(const char* str, Language lang = Language::Chinese,
+                                  ParserEngine engine = ParserEngine::RecursiveDescent,
+                                  const Vocabulary* vocab = nullptr)
+    : cc_(Make(str, lang, engine, vocab)) {
+  }
+
+  // Create an empty convertor, to be fed with Reset() or Convert()
+  explicit ChineseNumberConvertor(Language lang = Language::Chinese,
+                                  ParserEngine engine = ParserEngine::RecursiveDescent,
+                                  const Vocabulary* vocab = nullptr)
+    : ChineseNumberConvertor("", lang, engine, vocab) {
+  }
+
+  void Reset(std::string_view str) {
+    std::visit([&](auto& cc) { cc.Reset(str); }, cc_);
+  }
+
+  const std::string& Convert(std::string_view str) {
+    return std::visit([&](auto& cc) -> const std::string& { return cc.Convert(str); }, cc_);
+  }
+
+  void Convert(std::string_view str, OutputSink& sink) {
+    std::visit([&](auto& cc) { cc.Convert(str, sink); }, cc_);
+  }
+
+  const std::string& Evaluate() {
+    return std::visit([](auto& cc) -> const std::string& { return cc.Evaluate(); }, cc_);
+  }
+
+  const std::string& operator()() {
+    return Evaluate();
+  }
+
+  const std::vector<NumeralSpan>& Extract() {
+    return std::visit([](auto& cc) -> const std::vector<NumeralSpan>& { return cc.Extract(); }, cc_);
+  }
+
+  const std::vector<NumeralSpan>& Extract(std::string_view str) {
+    return std::visit([&](auto& cc) -> const std::vector<NumeralSpan>& { return cc.Extract(str); }, cc_);
+  }
+
+  const ConversionStats& Stats() const {
+    return std::visit([](auto& cc) -> const ConversionStats& { return cc.Stats(); }, cc_);
+  }
+
+  void SetUTF8ErrorPolicy(UTF8ErrorPolicy policy) {
+    std::visit([&](auto& cc) { cc.SetUTF8ErrorPolicy(policy); }, cc_);
+  }
+
+  const UTF8Errors& InvalidUTF8() const {
+    return std::visit([](auto& cc) -> const UTF8Errors& { return cc.InvalidUTF8(); }, cc_);
+  }
+
+  void SetLexicon(const PhraseLexicon* lexicon) {
+    std::visit([&](auto& cc) { cc.SetLexicon(lexicon); }, cc_);
+  }
+
+  Language language() const {
+    return cc_.index() == 1 ? Language::Japanese : Language::Chinese;
+  }
+
+private:
+  using Variant = std::variant<BasicNumberConvertor<Language::Chinese>,
+                               BasicNumberConvertor<Language::Japanese>>;
+
+  Variant cc_;
+
+  friend class StreamConvertor;
+  friend class IncrementalConvertor;
+
+  static Variant Make(const char* str, Language lang, ParserEngine engine, const Vocabulary* vocab) {
+    if (lang == Language::Japanese) {
+      return Variant(std::in_place_index<1>, str, engine, vocab);
+    }
+    return Variant(std::in_place_index<0>, str, engine, vocab);
+  }
+};
+
+
+/*
+   Converts a text received in chunks. Feed() returns the output for the part
+   of the input that can no longer change, and keeps the rest, usually
+   kMaxPending bytes, until more input comes or Finish() is called. A token
+   starting kMaxPending bytes before the end of the input received so far is
+   parsed exactly as it would be with the whole text, even when a UTF-8 char,
+   a numeral or a ゼロ/マイナス or other token of several chars is cut by a
+   chunk boundary. A numeral that is still going on at the end of the input,
+   such as a long run of 亿亿亿, is kept whole until its end comes, so the
+   output is always that of the whole text.
+
+     sisi::StreamConvertor sc;
+     while (read(chunk)) write(sc.Feed(chunk));
+     write(sc.Finish());
+ */
+class StreamConvertor {
+public:
+  enum : size_t {
+    kMaxPending = 1024,
+  };
+
+  explicit StreamConvertor(Language lang = Language::Chinese,
+                           ParserEngine engine = ParserEngine::RecursiveDescent,
+                           const Vocabulary* vocab = nullptr)
+    : cc_(lang, engine, vocab) {
+  }
+
+  // Append a chunk and return the output that is final so far. The result is
+  // valid until the next call.
+  std::string_view Feed(std::string_view chunk) {
+    pending_.append(chunk.data(), chunk.size());
+    if (pending_.size() <= std::max<size_t>(kMaxPending, retry_size_)) {
+      return std::string_view();
+    }
+    // Stop at the start of a UTF-8 char
+    size_t stop = pending_.size() - kMaxPending;
+    while (stop > 0 && ((uint8_t)pending_[stop] & 0xc0) == 0x80) {
+      stop--;
+    }
+    return Convert(stop);
+  }
+
+  // Flush the rest of the input. The convertor can then be used for a new
+  // stream.
+  std::string_view Finish() {
+    std::string_view out = Convert(std::string_view::npos);
+    last_is_num_ = false;
+    retry_size_ = 0;
+    return out;
+  }
+
+private:
+  ChineseNumberConvertor cc_;
+  std::string            pending_;
+  bool                   last_is_num_ = false;
+  size_t                 retry_size_ = 0;     // of pending_ to try again at, see Convert()
+
+  std::string_view Convert(size_t stop) {
+    return std::visit([&](auto& cc) -> std::string_view {
+      cc.Restart(pending_);
+      cc.stop_offset_ = stop;
+      cc.last_is_num_ = last_is_num_;
+      cc.Start();
+      if (stop != std::string_view::npos &&
+          (cc.lookahead_.value == cc.TOKEN_TYPE_EOF || cc.str_.Frontier() > pending_.size())) {
+        // A numeral crossing stop read up to the end of the input, which
+        // may still go on. Try again once the input is twice as long, so
+        // that a long numeral is parsed a bounded number of times per byte.
+        retry_size_ = pending_.size() * 2;
+        return std::string_view();
+      }
+      retry_size_ = 0;
+      last_is_num_ = cc.last_is_num_;
+      pending_.erase(0, cc.TokenOffset());
+      return cc.out_;
+    }, cc_.cc_);
+  }
+};
+
+
+/*
+   Keeps the conversion of a text up to date while the text is edited, e.g.
+   in an editor or an input method. The parse is kept as the boundaries of
+   its segments, which are numerals and runs of other text of at most
+   kMaxSegmentSize bytes. An edit re-parses from the first segment whose
+   parse read any of the edited bytes, such as 三 when 千 is typed right
+   after it, up to the first boundary following the edit where the parse is
+   back in step with the previous one. Only the output of the segments in
+   between is replaced. Apart from moving the bytes of the text and of the
+   output that follow the edit, the work does not depend on the length of
+   the text.
+
+     sisi::IncrementalConvertor ic;
+     ic.Assign(text);
+     auto changed = ic.Edit(pos, pos, "千");     // typed at pos
+     redraw(changed.begin, changed.old_end, ic.Output());
+ */
+class IncrementalConvertor {
+public:
+  // The bytes [begin, old_end) of the previous output that an edit replaced
+  // with [begin, new_end) of the new one
+  struct OutputEdit {
+    size_t begin;
+    size_t old_end;
+    size_t new_end;
+  };
+
+  explicit IncrementalConvertor(Language lang = Language::Chinese,
+                                ParserEngine engine = ParserEngine::RecursiveDescent)
+    : cc_(lang, engine) {
+  }
+
+  // Convert a whole new text
+  const std::string& Assign(std::string_view text) {
+    text_.assign(text.data(), text.size());
+    out_.clear();
+    bounds_.clear();
+    Parse({ 0, 0, 0, false }, std::string_view::npos, &out_, &bounds_);
+    gap_begin_ = gap_end_ = bounds_.size();
+    return out_;
+  }
+
+  // Replace the bytes [begin, end) of the text with text
+  OutputEdit Edit(size_t begin, size_t end, std::string_view text) {
+    end = std::min(end, text_.size());
+    begin = std::min(begin, end);
+
+    // Start from the first segment that read the edited bytes. The last
+    // boundary is always found, as it read the end of the text.
+    size_t k = FindBound(1, [&](const SegmentBoundary& b) { return b.reach > begin; }) - 1;
+    const SegmentBoundary start = Bound(k);
+    MoveGap(k);
+    text_.replace(begin, end - begin, text.data(), text.size());
+    size_t edit_end = begin + text.size();
+
+    // The boundaries after the gap now have their offsets in the new text.
+    // The first one following the edit where the new parse has the same
+    // state is where it is back in step.
+    size_t o = FindBound(k, [&](const SegmentBoundary& b) { return b.in >= edit_end; });
+    SegmentBoundary from = start;
+    size_t window = BasicNumberConvertor<Language::Chinese>::kMaxSegmentSize;
+    size_t checked = 0;
+    bool in_step = false;
+    chunk_.clear();
+    parsed_.clear();
+    while (true) {
+      Parse(from, std::max(edit_end, from.in) + window, &chunk_, &parsed_);
+      window *= 2;
+      for (; checked < parsed_.size() && !in_step; checked++) {
+        const SegmentBoundary& b = parsed_[checked];
+        if (b.in < edit_end) {
+          continue;
+        }
+        while (o < NumBounds() && Bound(o).in < b.in) {
+          o++;
+        }
+        in_step = o < NumBounds() && Bound(o).in == b.in && Bound(o).last_is_num == b.last_is_num;
+      }
+      if (in_step || parsed_.back().in == text_.size()) {
+        break;
+      }
+      // Go on from where the parse stopped
+      from = parsed_.back();
+      parsed_.pop_back();
+      checked = parsed_.size();
+    }
+
+    // Replace the boundaries [k, o) and their output
+    OutputEdit edit;
+    edit.begin = start.out;
+    size_t keep = parsed_.size();
+    if (in_step) {
+      keep = --checked;
+      edit.old_end = Bound(o).out;
+      edit.new_end = parsed_[checked].out;
+    } else {
+      o = NumBounds();
+      edit.old_end = out_.size();
+      edit.new_end = start.out + chunk_.size();
+    }
+    out_.replace(edit.begin, edit.old_end - edit.begin, chunk_, 0, edit.new_end - edit.begin);
+    gap_begin_ = k;
+    gap_end_ += o - k;
+    if (gap_end_ - gap_begin_ < keep) {
+      GrowGap(keep);
+    }
+    std::copy(parsed_.begin(), parsed_.begin() + keep, bounds_.begin() + gap_begin_);
+    gap_begin_ += keep;
+    if (in_step) {
+      // It was reached by reading other bytes
+      bounds_[gap_end_].reach = text_.size() + 1 - parsed_[checked].reach;
+    }
+    return edit;
+  }
+
+  const std::string& Text() const {
+    return text_;
+  }
+
+  const std::string& Output() const {
+    return out_;
+  }
+
+private:
+  ChineseNumberConvertor       cc_;
+  std::string                  text_;
+  std::string                  out_;
+  // Boundaries of the segments of text_, the last one at its end. There is a
+  // gap of unused ones at the last edit. The boundaries after it have their
+  // offsets counted back from the end of text_ and out_, so that edits do not
+  // change them. See Bound().
+  std::vector<SegmentBoundary> bounds_;
+  size_t                       gap_begin_ = 0;
+  size_t                       gap_end_   = 0;
+  std::string                  chunk_;    // output of the segments parsed again
+  std::vector<SegmentBoundary> parsed_;   // and their boundaries
+
+  size_t NumBounds() const {
+    return bounds_.size() - (gap_end_ - gap_begin_);
+  }
+
+  SegmentBoundary Bound(size_t i) const {
+    if (i < gap_begin_) {
+      return bounds_[i];
+    }
+    return FromEnd(bounds_[i + gap_end_ - gap_begin_]);
+  }
+
+  // Turn offsets counted from the start into ones counted from the end, and
+  // the other way round
+  SegmentBoundary FromEnd(const SegmentBoundary& b) const {
+    return { text_.size() - b.in, out_.size() - b.out, text_.size() + 1 - b.reach, b.last_is_num };
+  }
+
+  // First index i from lo on for which pred(Bound(i)) is true, if it is
+  // false for every index before
+  template <typename Pred>
+  size_t FindBound(size_t lo, Pred pred) const {
+    size_t hi = NumBounds();
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (pred(Bound(mid))) {
+        hi = mid;
+      } else {
+        lo = mid + 1;
+      }
+    }
+    return lo;
+  }
+
+  // Put the gap before the boundary i
+  void MoveGap(size_t i) {
+    while (gap_begin_ > i) {
+      bounds_[--gap_end_] = FromEnd(bounds_[--gap_begin_]);
+    }
+    while (gap_begin_ < i) {
+      bounds_[gap_begin_++] = FromEnd(bounds_[gap_end_++]);
+    }
+  }
+
+  // Make room for at least n boundaries in the gap
+  void GrowGap(size_t n) {
+    size_t grow = std::max(n, bounds_.size() / 2 + 16);
+    bounds_.insert(bounds_.begin() + gap_end_, grow, SegmentBoundary{});
+    gap_end_ += grow;
+  }
+
+  // Parse text_ from the boundary from up to the first boundary at or after
+  // stop, appending the output to out and the boundaries to bounds
+  void Parse(const SegmentBoundary& from, size_t stop, std::string* out, std::vector<SegmentBoundary>* bounds) {
+    std::visit([&](auto& cc) {
+      cc.Restart(std::string_view(text_).substr(from.in));
+      cc.stop_offset_ = stop == std::string_view::npos ? stop : stop - from.in;
+      cc.last_is_num_ = from.last_is_num;
+      cc.boundaries_ = bounds;
+      size_t first = bounds->size();
+      {
+        OutputSink sink(out);
+        cc.Start(sink);
+      }
+      cc.boundaries_ = nullptr;
+      for (size_t i = first; i < bounds->size(); i++) {
+        (*bounds)[i].in    += from.in;
+        (*bounds)[i].reach += from.in;
+        (*bounds)[i].out   += from.out;
+      }
+      // The first one is from, but what was read to get there is unknown here
+      (*bounds)[first].reach = from.reach;
+    }, cc_.cc_);
+  }
+};
+
+
+// Style of the numerals written by NumeralWriter
+enum class NumeralStyle : uint8_t {
+    Lower,      // 一千零二十
+    Upper       // 壹仟零贰拾, as on cheques and invoices
+};
+
+/*
+   The opposite of ChineseNumberConvertor: spells numbers as numerals, e.g.
+   1410778724 as 十四亿一千零七十七万八千七百二十四, using the chars of
+   NumeralChars. In Chinese, 零 stands for each run of zeros between two
+   digits, except for the zeros that end a group of four digits followed by
+   its unit, as in 一千万一千, and 10^12 is 万亿. Japanese has no 零, uses 兆
+   and 京 for 10^12 and 10^16, and drops the 一 before 十, 百 and 千. What is
+   written reads back as the same value.
+
+     sisi::NumeralWriter writer;
+     char buf[sisi::NumeralWriter::kMaxSize];
+     auto [end, ec] = writer.Write(buf, buf + sizeof(buf), 1410778724);
+ */
+class NumeralWriter {
+public:
+  enum : size_t {
+    kMaxSize = 192,   // of a number, 19 digits with 零 and units and a sign
+  };
+
+  explicit NumeralWriter(Language lang = Language::Chinese, NumeralStyle style = NumeralStyle::Lower)
+    : lang_(lang) {
+    int s = int(style);
+    for (int i = 0; i < 10; i++) {
+      memcpy(digits_[i], NumeralChars::kDigits[s] + 3 * i, 3);
+    }
+    for (int i = 0; i < 3; i++) {
+      memcpy(small_units_[i], NumeralChars::kSmallUnits[i] + 3 * s, 3);
+    }
+    memcpy(big_units_[0], NumeralChars::kWan, 3);
+    memcpy(big_units_[1], NumeralChars::kYi[int(lang)], 3);
+    memcpy(big_units_[2], lang == Language::Japanese ? NumeralChars::kZhao : NumeralChars::kWan, 3);
+    memcpy(big_units_[3], lang == Language::Japanese ? NumeralChars::kJing : NumeralChars::kYi[int(lang)], 3);
+    memcpy(negative_, NumeralChars::kNegative[int(lang)], 3);
+    memcpy(point_, NumeralChars::kPoint, 3);
+    // 十五 but 壹拾伍, financial numerals keep every digit
+    omit_one_ = style == NumeralStyle::Lower;
+  }
+
+  // Write n into [first, last), like std::to_chars
+  std::to_chars_result Write(char* first, char* last, int64_t n) const {
+    if (size_t(last - first) >= kMaxSize) {
+      return { WriteUnchecked(first, n), std::errc() };
+    }
+    char buf[kMaxSize];
+    size_t size = WriteUnchecked(buf, n) - buf;
+    if (size > size_t(last - first)) {
+      return { last, std::errc::value_too_large };
+    }
+    memcpy(first, buf, size);
+    return { first + size, std::errc() };
+  }
+
+  // Write the digits one by one, as in 二零二三, skipping anything else
+  void WriteDigits(std::string_view digits, OutputSink& sink) const {
+    for (char ch : digits) {
+      if (IsDigit(ch)) {
+        sink.Append(digits_[ch - '0'], 3);
+      }
+    }
+  }
+
+  // Rewrite the numbers in text as numerals, as in 共1,200.5公里 ->
+  // 共一千二百点五公里. A number that starts with 0, or has more than 18
+  // digits, is spelled digit by digit, as phone numbers and IDs are read. A -
+  // is a sign only at the start or after a space or a non-ASCII char, so that
+  // 2023-10-17 stays a date. Numbers next to an ASCII letter, as in mp3, and
+  // dotted ones such as 1.2.3 are kept as they are.
+  void Convert(std::string_view text, OutputSink& sink) const {
+    const char* const start = text.data();
+    const char* const end = start + text.size();
+    const char* copied = start;
+    const char* p = start;
+    while (p < end) {
+      if (!IsDigit(*p)) {
+        p++;
+        continue;
+      }
+      // The integer part, with optional thousands separators as in 1,200
+      const char* begin = p;
+      while (p < end && IsDigit(*p)) {
+        p++;
+      }
+      if (p - begin <= 3) {
+        while (IsDigitGroup(p, end)) {
+          p += 4;
+        }
+      }
+      const char* int_end = p;
+      const char* frac = nullptr;
+      int dots = 0;
+      while (p + 1 < end && *p == '.' && IsDigit(p[1])) {
+        frac = frac ? frac : p + 1;
+        dots++;
+        for (p++; p < end && IsDigit(*p); p++) {
+        }
+      }
+      if (dots > 1 || (begin > start && IsAlpha(begin[-1])) || (p < end && IsAlpha(*p))) {
+        continue;
+      }
+
+      bool negative = begin > start && begin[-1] == '-' && (begin - 1 == start || IsSignPrefix(begin[-2]));
+      sink.Append(copied, begin - copied - negative);
+      if (negative) {
+        sink.Append(negative_, 3);
+      }
+      std::string_view digits(begin, int_end - begin);
+      size_t size = std::count_if(digits.begin(), digits.end(), IsDigit);
+      if (size > 18 || (size > 1 && *begin == '0')) {
+        WriteDigits(digits, sink);
+      } else {
+        int64_t n = 0;
+        for (char ch : digits) {
+          n = IsDigit(ch) ? n * 10 + (ch - '0') : n;
+        }
+        char buf[kMaxSize];
+        sink.Append(buf, WriteUnchecked(buf, n) - buf);
+      }
+      if (frac) {
+        sink.Append(point_, 3);
+        WriteDigits(std::string_view(frac, p - frac), sink);
+      }
+      copied = p;
+    }
+    sink.Append(copied, end - copied);
+  }
+
+  std::string Convert(std::string_view text) const {
+    std::string out;
+    {
+      OutputSink sink(&out);
+      Convert(text, sink);
+    }
+    return out;
+  }
+
+private:
+  Language lang_;
+  bool     omit_one_;
+  // Each char takes 4 bytes, for Put() to copy a whole word
+  char     digits_[10][4]      = {};
+  char     small_units_[3][4]  = {};    // 十 百 千
+  char     big_units_[4][4]    = {};    // of 10^4, 10^8, 10^12 and 10^16
+  char     negative_[4]        = {};
+  char     point_[4]           = {};
+
+  static bool IsDigit(char ch) {
+    return ch >= '0' && ch <= '9';
+  }
+
+  static bool IsAlpha(char ch) {
+    return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z');
+  }
+
+  static bool IsSignPrefix(char ch) {
+    return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r' || (ch & 0x80);
+  }
+
+  // Whether p is at a thousands separator and the three digits after it
+  static bool IsDigitGroup(const char* p, const char* end) {
+    return end - p >= 4 && p[0] == ',' && IsDigit(p[1]) && IsDigit(p[2]) && IsDigit(p[3]) &&
+           (end - p == 4 || !IsDigit(p[4]));
+  }
+
+  // Copy the 3 bytes of ch, and a spare one that the next char overwrites
+  static char* Put(char* p, const char* ch) {
+    memcpy(p, ch, 4);
+    return p + 3;
+  }
+
+  // Write n into a buffer of at least kMaxSize bytes
+  char* WriteUnchecked(char* p, int64_t n) const {
+    if (n == 0) {
+      return Put(p, digits_[0]);
+    }
+    uint64_t u = n;
+    if (n < 0) {
+      p = Put(p, negative_);
+      u = -u;
+    }
+    // Groups of four digits, the least significant first
+    unsigned groups[5] = {};
+    int top = 0;
+    for (; u >= 10000; u /= 10000) {
+      groups[top++] = u % 10000;
+    }
+    groups[top] = u;
+
+    const bool japanese = lang_ == Language::Japanese;
+    bool written = false;
+    bool zero = false;        // a 零 is due before the next digit
+    for (int level = top; level >= 0; level--) {
+      unsigned g = groups[level];
+      if (g == 0) {
+        zero = true;
+      } else {
+        const unsigned digits[4] = { g / 1000, g / 100 % 10, g / 10 % 10, g % 10 };
+        for (int i = 0; i < 4; i++) {
+          unsigned d = digits[i];
+          int unit = 3 - i;
+          if (d == 0) {
+            zero = written;
+            continue;
+          }
+          if (zero && !japanese) {
+            p = Put(p, digits_[0]);
+          }
+          zero = false;
+          bool omit = d == 1 && unit != 0 && omit_one_ && (japanese || (unit == 1 && !written));
+          if (!omit) {
+            p = Put(p, digits_[d]);
+          }
+          if (unit != 0) {
+            p = Put(p, small_units_[unit - 1]);
+          }
+          written = true;
+        }
+        // The zeros that end a group come before its unit, as in 一千万一千
+        zero = false;
+      }
+      if (level == 0) {
+        break;
+      }
+      if (japanese) {
+        if (g != 0) {
+          p = Put(p, big_units_[level - 1]);
+        }
+      } else if (level == 2) {
+        // 亿 also ends 万亿, as in 三万亿
+        if (g != 0 || groups[3] != 0) {
+          p = Put(p, big_units_[1]);
+        }
+      } else if (g != 0) {
+        p = Put(p, big_units_[level - 1]);
+        if (level == 4) {
+          p = Put(p, big_units_[3]);    // 亿亿
+        }
+      }
+    }
+    return p;
+  }
+};
 
 #undef LOOKAHEAD
-#undef LOOKAHEAD_STR
+#undef CLASS
 #undef SISI_LOGD
 #undef SISI_RETURN
 #undef SISI_EXIT
 #undef SISI_ENTER
 #undef SISI_ENABLE_LOG
+#undef SISI_STAT
 #undef SISI_IS_FIRST_NE
 #undef SISI_IS_FIRST_O
 
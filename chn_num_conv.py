@@ -33,6 +33,7 @@ The BNF Grammar is list as follows:
    NonZero -> 一 | 二 | 三 | 四 | 五 | 六 | 七 | 八 | 九
 """
 
+import os
 import re
 from enum import Enum
 
@@ -317,11 +318,29 @@ class ChineseNumberConvertor():
         return self._start()
 
 
+def convert_batch(strings, language=Language.Chinese, threads=0):
+    return [ChineseNumberConvertor(s, language=language)() for s in strings]
+
+
+# The parser above, which replace_chinese_nums() also uses for its tables
+PyChineseNumberConvertor = ChineseNumberConvertor
+
+# Use the C++ convertor when the _chn_num_conv extension is built, unless
+# SISI_PURE_PYTHON is set. It takes the same arguments, and convert_batch()
+# converts on several threads without holding the GIL.
+NATIVE = False
+if not os.environ.get("SISI_PURE_PYTHON"):
+    try:
+        from _chn_num_conv import ChineseNumberConvertor, convert_batch
+        NATIVE = True
+    except ImportError:
+        pass
+
 
 def replace_chinese_nums(s, ignore_quant=False, quant_unit :str=None, unit_dict :dict=None, chn_dict :dict=None, language=Language.Chinese):
     if quant_unit is None:
         quant_unit = "款年月日个台天部代元块"
-    cnc = ChineseNumberConvertor(s, language=language)
+    cnc = PyChineseNumberConvertor(s, language=language)
     if unit_dict is not None:
         cnc.unit_dict = unit_dict
     if chn_dict is not None:
@@ -0,0 +1,337 @@
+/*
+
+Copyright 2023 Sisi
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ * */
+
+#ifndef _SISI_CHN_NUM_CONV_BATCH_H_
+#define _SISI_CHN_NUM_CONV_BATCH_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <thread>
+
+#include "chn_num_conv.h"
+#include "chn_num_conv_cache.h"
+
+namespace sisi {
+
+/*
+   Converts many independent strings on several threads.
+
+   The items are cut into chunks and every worker starts with an equal range of
+   chunks. A worker takes chunks from the front of its own range, and once it is
+   empty, steals the back half of the range of another worker. Each worker keeps
+   one convertor per language and its own output buffer, which are reused from
+   one batch to the next. When all items are converted, their outputs are copied
+   in input order into a single contiguous arena. The threads are started once,
+   wait between batches, and the calling thread is the first worker.
+
+     sisi::BatchConvertor batch(8);
+     batch.Convert(lines, sisi::Language::Chinese);
+     for (size_t i = 0; i < batch.size(); i++) use(batch[i]);
+ */
+class BatchConvertor {
+public:
+  explicit BatchConvertor(size_t num_threads = 0,
+                          ParserEngine engine = ParserEngine::RecursiveDescent,
+                          const Vocabulary* vocab = nullptr) {
+    if (num_threads == 0) {
+      num_threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+    }
+    for (size_t i = 0; i < num_threads; i++) {
+      workers_.emplace_back(new Worker(engine, vocab));
+    }
+    for (size_t i = 1; i < num_threads; i++) {
+      threads_.emplace_back([this, i] { WorkerLoop(*workers_[i]); });
+    }
+  }
+
+  BatchConvertor(const BatchConvertor&) = delete;
+  BatchConvertor& operator=(const BatchConvertor&) = delete;
+
+  ~BatchConvertor() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    start_.notify_all();
+    for (auto& t : threads_) {
+      t.join();
+    }
+  }
+
+  // Convert in[i] in language langs[i]
+  void Convert(std::span<const std::string_view> in, std::span<const Language> langs) {
+    Run(in, [&](size_t i) { return langs[i]; });
+  }
+
+  // Convert every item in the same language
+  void Convert(std::span<const std::string_view> in, Language lang) {
+    Run(in, [=](size_t) { return lang; });
+  }
+
+  // Number of items of the last batch
+  size_t size() const {
+    return offsets_.empty() ? 0 : offsets_.size() - 1;
+  }
+
+  // Output of the item i of the last batch, valid until the next Convert()
+  std::string_view operator[](size_t i) const {
+    return std::string_view(arena_.data() + offsets_[i], offsets_[i + 1] - offsets_[i]);
+  }
+
+  // All the outputs of the last batch, back to back
+  std::string_view Arena() const {
+    return arena_;
+  }
+
+  // Add the stats of every item converted from now on to hist, which must
+  // outlive the convertor or be unset with nullptr. The workers count into
+  // their own histograms and merge them into hist at the end of each batch.
+  // Nothing is counted unless built with SISI_ENABLE_STATS.
+  void SetStats(StatsHistogram* hist) {
+    stats_ = hist;
+  }
+
+  // Look every item up in cache before converting it, and cache the outputs
+  // of the others. The cache must outlive the convertor or be unset with
+  // nullptr, and can be shared with other convertors of the same Vocabulary.
+  void SetCache(ConversionCache* cache) {
+    cache_ = cache;
+  }
+
+  // Keep the phrases of lexicon as they are, see PhraseLexicon. The lexicon
+  // must outlive the convertor or be unset with nullptr, and a cache is only
+  // to be shared with convertors of the same lexicon.
+  void SetLexicon(const PhraseLexicon* lexicon) {
+    for (auto& w : workers_) {
+      w->chinese.SetLexicon(lexicon);
+      w->japanese.SetLexicon(lexicon);
+    }
+  }
+
+private:
+  enum : size_t {
+    kMaxItemsPerChunk = 256,
+    kChunksPerWorker  = 64,
+  };
+
+  struct Worker {
+    Worker(ParserEngine engine, const Vocabulary* vocab)
+      : chinese(engine, vocab), japanese(engine, vocab) {
+    }
+
+    BasicNumberConvertor<Language::Chinese>  chinese;
+    BasicNumberConvertor<Language::Japanese> japanese;
+    std::string            out;
+    std::vector<size_t>    items;      // items converted by this worker, in order
+#if SISI_ENABLE_STATS
+    StatsHistogram         stats;      // of the current batch
+#endif
+    // Chunks left to this worker: begin in the high 32 bits, end in the low ones
+    alignas(64) std::atomic<uint64_t> range;
+  };
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::string         arena_;
+  std::vector<size_t> offsets_;    // item i is [offsets_[i], offsets_[i + 1]) of arena_
+  std::vector<size_t> local_;      // offset of item i in the buffer of its worker
+  StatsHistogram*     stats_ = nullptr;
+  ConversionCache*    cache_ = nullptr;
+
+  // The threads of workers_[1] and up, which wait on start_ for the next
+  // phase of a batch, run task_ and tell done_ when the last one is through
+  std::vector<std::thread>          threads_;
+  std::mutex                        mutex_;
+  std::condition_variable           start_;
+  std::condition_variable           done_;
+  std::function<void(Worker&)>      task_;
+  uint64_t                          phase_ = 0;
+  size_t                            busy_ = 0;
+  bool                              stop_ = false;
+  std::exception_ptr                error_;     // the first one thrown by task_
+
+  static uint64_t MakeRange(uint64_t begin, uint64_t end) {
+    return (begin << 32) | end;
+  }
+
+  static bool PopFront(Worker& w, size_t* chunk) {
+    uint64_t r = w.range.load(std::memory_order_relaxed);
+    while ((r >> 32) < (r & 0xffffffff)) {
+      if (w.range.compare_exchange_weak(r, MakeRange((r >> 32) + 1, r & 0xffffffff))) {
+        *chunk = r >> 32;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Take the back half of the range of a victim, keep its first chunk and
+  // make the rest the new range of the thief
+  bool Steal(Worker& thief, size_t* chunk) {
+    for (auto& victim : workers_) {
+      uint64_t r = victim->range.load(std::memory_order_relaxed);
+      while ((r >> 32) < (r & 0xffffffff)) {
+        uint64_t begin = r >> 32, end = r & 0xffffffff;
+        uint64_t mid = end - std::max<uint64_t>(1, (end - begin) / 2);
+        if (victim->range.compare_exchange_weak(r, MakeRange(begin, mid))) {
+          thief.range.store(MakeRange(mid + 1, end));
+          *chunk = mid;
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  template <typename LangOf>
+  void Run(std::span<const std::string_view> in, LangOf lang_of) {
+    size_t n = in.size();
+    offsets_.assign(n + 1, 0);
+    local_.resize(n);
+    size_t num_workers = workers_.size();
+    size_t items_per_chunk = std::clamp<size_t>(n / (num_workers * kChunksPerWorker), 1, kMaxItemsPerChunk);
+    size_t num_chunks = (n + items_per_chunk - 1) / items_per_chunk;
+    for (size_t i = 0; i < num_workers; i++) {
+      workers_[i]->range.store(MakeRange(num_chunks * i / num_workers, num_chunks * (i + 1) / num_workers));
+    }
+
+    // Convert, every worker into its own buffer
+    ForEachWorker([&](Worker& w) {
+      w.out.clear();
+      w.items.clear();
+      size_t chunk;
+      while (PopFront(w, &chunk) || Steal(w, &chunk)) {
+        size_t end = std::min(n, (chunk + 1) * items_per_chunk);
+        for (size_t i = chunk * items_per_chunk; i < end; i++) {
+          local_[i] = w.out.size();
+          Language lang = lang_of(i);
+          auto convert = [&]() {
+            OutputSink sink(&w.out);
+            if (lang == Language::Japanese) {
+              w.japanese.Convert(in[i], sink);
+#if SISI_ENABLE_STATS
+              w.stats.Add(w.japanese.Stats());
+#endif
+            } else {
+              w.chinese.Convert(in[i], sink);
+#if SISI_ENABLE_STATS
+              w.stats.Add(w.chinese.Stats());
+#endif
+            }
+            sink.Flush();
+            return std::string_view(w.out).substr(local_[i]);
+          };
+          if (!cache_) {
+            convert();
+          } else if (auto cached = cache_->Convert(in[i], lang, convert); w.out.size() == local_[i]) {
+            w.out.append(cached.view());    // a hit, nothing was converted
+          }
+          offsets_[i + 1] = w.out.size() - local_[i];
+          w.items.push_back(i);
+        }
+      }
+    });
+
+    for (size_t i = 0; i < n; i++) {
+      offsets_[i + 1] += offsets_[i];
+    }
+#if SISI_ENABLE_STATS
+    for (auto& w : workers_) {
+      if (stats_) {
+        stats_->Merge(w->stats);
+      }
+      w->stats.Clear();
+    }
+#endif
+    arena_.resize(offsets_[n]);
+
+    // Gather, in input order
+    ForEachWorker([&](Worker& w) {
+      for (size_t i : w.items) {
+        memcpy(arena_.data() + offsets_[i], w.out.data() + local_[i], offsets_[i + 1] - offsets_[i]);
+      }
+    });
+  }
+
+  // Run fn on every worker at once and wait for all of them. An exception
+  // thrown by fn is rethrown here, once every worker is done.
+  template <typename Fn>
+  void ForEachWorker(Fn fn) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      task_ = fn;
+      busy_ = threads_.size();
+      phase_++;
+    }
+    start_.notify_all();
+    RunTask(*workers_[0]);
+    std::exception_ptr error;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      done_.wait(lock, [this] { return busy_ == 0; });
+      task_ = nullptr;
+      std::swap(error, error_);
+    }
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+  void WorkerLoop(Worker& w) {
+    uint64_t phase = 0;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      start_.wait(lock, [&] { return stop_ || phase_ != phase; });
+      if (stop_) {
+        return;
+      }
+      phase = phase_;
+      lock.unlock();
+      RunTask(w);
+      lock.lock();
+      if (--busy_ == 0) {
+        done_.notify_one();
+      }
+    }
+  }
+
+  void RunTask(Worker& w) {
+    try {
+      task_(w);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!error_) {
+        error_ = std::current_exception();
+      }
+    }
+  }
+};
+
+}
+
+#endif
@@ -0,0 +1,454 @@
+/*
+
+Copyright 2023 Sisi
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ * */
+
+#ifndef _SISI_CHN_NUM_CONV_CACHE_H_
+#define _SISI_CHN_NUM_CONV_CACHE_H_
+
+#include <atomic>
+#include <bit>
+#include <cstring>
+#include <new>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <utility>
+#include <vector>
+
+#include "chn_num_conv.h"
+
+namespace sisi {
+
+/*
+   Remembers the outputs of recent conversions, for inputs that come again and
+   again such as templated replies or menu items. Entries are keyed by the
+   input and its language, the engine does not matter as both give the same
+   output, but convertors sharing a cache must read the same Vocabulary. The
+   entries are spread over shards by hash, each with its own lock and its
+   share of the byte budget. A lookup only takes its shard's lock as a
+   reader, so lookups do not wait for each other. When a shard is full, the
+   CLOCK algorithm evicts entries that were not looked up since the clock
+   hand last passed them. Convert() only caches an input the second time it
+   sees it, so that the many inputs that never come again neither pay for
+   an insertion nor push out the ones that do.
+
+   A cached result is a reference counted view of its entry, which stays
+   valid as long as the result is kept, even once the entry is evicted.
+
+     sisi::ConversionCache cache(64 << 20);
+     sisi::ChineseNumberConvertor cc;
+     auto out = cache.Convert(line, cc);
+     write(out.view());
+ */
+class ConversionCache {
+  struct Entry;
+
+public:
+  enum : size_t {
+    kEntryOverhead = 64,    // bytes charged for an entry besides its strings
+  };
+
+  struct Counters {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t insertions;
+    uint64_t evictions;
+    size_t   entries;
+    size_t   bytes;
+  };
+
+  class Result {
+  public:
+    Result() = default;
+
+    Result(const Result& other)
+      : entry_(other.entry_), output_(other.output_) {
+      Retain(entry_);
+    }
+
+    Result(Result&& other) noexcept
+      : entry_(std::exchange(other.entry_, nullptr)), output_(other.output_) {
+    }
+
+    Result& operator=(Result other) noexcept {
+      std::swap(entry_, other.entry_);
+      std::swap(output_, other.output_);
+      return *this;
+    }
+
+    ~Result() {
+      Release(entry_);
+    }
+
+    // The output. If cached(), it is valid as long as this result or a copy
+    // of it, otherwise it is the output of the convertor, valid until its
+    // next conversion.
+    std::string_view view() const {
+      return entry_ ? entry_->Output() : output_;
+    }
+
+    bool cached() const {
+      return entry_ != nullptr;
+    }
+
+    // False for a lookup that missed
+    explicit operator bool() const {
+      return entry_ != nullptr || output_.data() != nullptr;
+    }
+
+  private:
+    friend class ConversionCache;
+
+    // Takes over a reference to entry
+    explicit Result(Entry* entry)
+      : entry_(entry) {
+    }
+
+    explicit Result(std::string_view output)
+      : output_(output) {
+    }
+
+    Entry*           entry_ = nullptr;
+    std::string_view output_;
+  };
+
+  // Keep at most capacity bytes of entries, in num_shards shards, rounded up
+  // to a power of two
+  explicit ConversionCache(size_t capacity, size_t num_shards = 16) {
+    while (shard_bits_ < 16 && (size_t(1) << shard_bits_) < num_shards) {
+      shard_bits_++;
+    }
+    shards_ = std::vector<Shard>(size_t(1) << shard_bits_);
+    for (auto& shard : shards_) {
+      shard.capacity = capacity >> shard_bits_;
+      shard.table.resize(kMinTableSize);
+      shard.seen_mask = std::bit_ceil(std::max<size_t>(kMinSeenSize, shard.capacity / kBytesPerSeen)) - 1;
+      shard.seen.reset(new std::atomic<uint64_t>[shard.seen_mask + 1]());
+    }
+  }
+
+  ConversionCache(const ConversionCache&) = delete;
+  ConversionCache& operator=(const ConversionCache&) = delete;
+
+  ~ConversionCache() {
+    Clear();
+  }
+
+  // The cached output of input, or an empty result
+  Result Find(std::string_view input, Language lang) {
+    uint64_t hash = Hash(input, lang);
+    return Find(ShardOf(hash), hash, input, lang);
+  }
+
+  // Cache output as the conversion of input. If another thread got there
+  // first, its entry is kept and returned. An entry larger than a shard is
+  // returned without being cached.
+  Result Insert(std::string_view input, Language lang, std::string_view output) {
+    uint64_t hash = Hash(input, lang);
+    return Insert(ShardOf(hash), hash, input, lang, output);
+  }
+
+  // Look input up, or call convert, which returns the output of input, and
+  // cache it if input was seen before
+  template <typename Fn>
+  Result Convert(std::string_view input, Language lang, Fn&& convert) {
+    uint64_t hash = Hash(input, lang);
+    Shard& shard = ShardOf(hash);
+    Result result = Find(shard, hash, input, lang);
+    if (result) {
+      return result;
+    }
+    std::string_view output = convert();
+    if (!Admit(shard, hash)) {
+      return Result(output);
+    }
+    return Insert(shard, hash, input, lang, output);
+  }
+
+  Result Convert(std::string_view input, ChineseNumberConvertor& cc) {
+    return Convert(input, cc.language(), [&]() -> std::string_view { return cc.Convert(input); });
+  }
+
+  // Drop every entry. Results that are kept stay valid.
+  void Clear() {
+    for (auto& shard : shards_) {
+      std::unique_lock lock(shard.mutex);
+      for (Entry* entry : shard.clock) {
+        Release(entry);
+      }
+      shard.clock.clear();
+      shard.table.assign(kMinTableSize, Slot());
+      for (size_t i = 0; i <= shard.seen_mask; i++) {
+        shard.seen[i].store(0, std::memory_order_relaxed);
+      }
+      shard.hand = 0;
+      shard.bytes = 0;
+    }
+  }
+
+  Counters GetCounters() const {
+    Counters c = {};
+    for (auto& shard : shards_) {
+      c.hits       += shard.hits.load(std::memory_order_relaxed);
+      c.misses     += shard.misses.load(std::memory_order_relaxed);
+      c.insertions += shard.insertions.load(std::memory_order_relaxed);
+      c.evictions  += shard.evictions.load(std::memory_order_relaxed);
+      std::shared_lock lock(shard.mutex);
+      c.entries    += shard.clock.size();
+      c.bytes      += shard.bytes;
+    }
+    return c;
+  }
+
+  // Share of the lookups that were hits
+  double HitRate() const {
+    Counters c = GetCounters();
+    return c.hits + c.misses ? double(c.hits) / (c.hits + c.misses) : 0;
+  }
+
+private:
+  enum : size_t {
+    kMinTableSize = 64,
+    kMinSeenSize  = 1024,
+    kBytesPerSeen = 256,    // of capacity per slot of the admission filter
+    kNotFound     = size_t(-1),
+  };
+
+  // Allocated in one block with the input and the output right after it, and
+  // freed once neither the cache nor a Result refers to it
+  struct Entry {
+    std::atomic<uint32_t> refs;
+    std::atomic<bool>     referenced;   // looked up since the clock hand passed
+    Language              lang;
+    uint64_t              hash;
+    size_t                slot;         // in the clock of its shard
+    size_t                input_size;
+    size_t                output_size;
+
+    static Entry* New(uint64_t hash, Language lang, std::string_view input, std::string_view output) {
+      void* mem = ::operator new(sizeof(Entry) + input.size() + output.size());
+      Entry* entry = new (mem) Entry{ { 1 }, { false }, lang, hash, 0, input.size(), output.size() };
+      memcpy(entry->Data(), input.data(), input.size());
+      memcpy(entry->Data() + input.size(), output.data(), output.size());
+      return entry;
+    }
+
+    char* Data() {
+      return reinterpret_cast<char*>(this + 1);
+    }
+
+    const char* Data() const {
+      return reinterpret_cast<const char*>(this + 1);
+    }
+
+    std::string_view Input() const {
+      return std::string_view(Data(), input_size);
+    }
+
+    std::string_view Output() const {
+      return std::string_view(Data() + input_size, output_size);
+    }
+
+    size_t Charge() const {
+      return sizeof(Entry) + input_size + output_size + kEntryOverhead;
+    }
+  };
+
+  // Open addressing with linear probing, the table is at most half full
+  struct Slot {
+    uint64_t hash  = 0;
+    Entry*   entry = nullptr;
+  };
+
+  struct alignas(64) Shard {
+    mutable std::shared_mutex  mutex;
+    std::vector<Slot>          table;
+    std::vector<Entry*>        clock;    // the entries, in no particular order
+    // Hashes of inputs seen once, by their high bits, see Admit()
+    std::unique_ptr<std::atomic<uint64_t>[]> seen;
+    size_t                     seen_mask = 0;
+    size_t                     hand = 0;
+    size_t                     bytes = 0;
+    size_t                     capacity = 0;
+    std::atomic<uint64_t>      hits = 0;
+    std::atomic<uint64_t>      misses = 0;
+    std::atomic<uint64_t>      insertions = 0;
+    std::atomic<uint64_t>      evictions = 0;
+  };
+
+  std::vector<Shard> shards_;
+  int                shard_bits_ = 0;
+
+  static void Retain(Entry* entry) {
+    if (entry) {
+      entry->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  static void Release(Entry* entry) {
+    if (entry && entry->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      entry->~Entry();
+      ::operator delete(entry);
+    }
+  }
+
+  static uint64_t Hash(std::string_view input, Language lang) {
+    return std::hash<std::string_view>()(input) ^ (uint64_t(lang) + 1) * 0x9e3779b97f4a7c15;
+  }
+
+  // The high bits pick the shard, the table of the shard uses the low ones
+  Shard& ShardOf(uint64_t hash) {
+    return shards_[shard_bits_ ? hash >> (64 - shard_bits_) : 0];
+  }
+
+  Result Find(Shard& shard, uint64_t hash, std::string_view input, Language lang) {
+    {
+      std::shared_lock lock(shard.mutex);
+      size_t i = Lookup(shard, hash, input, lang);
+      if (i != kNotFound) {
+        Entry* entry = shard.table[i].entry;
+        if (!entry->referenced.load(std::memory_order_relaxed)) {
+          entry->referenced.store(true, std::memory_order_relaxed);
+        }
+        Retain(entry);
+        shard.hits.fetch_add(1, std::memory_order_relaxed);
+        return Result(entry);
+      }
+    }
+    shard.misses.fetch_add(1, std::memory_order_relaxed);
+    return Result();
+  }
+
+  Result Insert(Shard& shard, uint64_t hash, std::string_view input, Language lang, std::string_view output) {
+    Entry* entry = Entry::New(hash, lang, input, output);
+    std::unique_lock lock(shard.mutex);
+    size_t i = Lookup(shard, hash, input, lang);
+    if (i != kNotFound) {
+      Release(entry);
+      Retain(shard.table[i].entry);
+      return Result(shard.table[i].entry);
+    }
+    if (entry->Charge() > shard.capacity) {
+      return Result(entry);
+    }
+    while (shard.bytes + entry->Charge() > shard.capacity) {
+      Evict(shard);
+    }
+    if (2 * (shard.clock.size() + 1) > shard.table.size()) {
+      Rehash(shard, 2 * shard.table.size());
+    }
+    Place(shard, hash, entry);
+    entry->slot = shard.clock.size();
+    shard.clock.push_back(entry);
+    shard.bytes += entry->Charge();
+    shard.insertions.fetch_add(1, std::memory_order_relaxed);
+    Retain(entry);    // for the cache
+    return Result(entry);
+  }
+
+  // Whether hash was seen since another one took its slot, and note it if
+  // not. Races between threads only make the filter forget a hash.
+  static bool Admit(Shard& shard, uint64_t hash) {
+    auto& seen = shard.seen[(hash >> 32) & shard.seen_mask];
+    if (seen.load(std::memory_order_relaxed) == hash) {
+      return true;
+    }
+    seen.store(hash, std::memory_order_relaxed);
+    return false;
+  }
+
+  static size_t Lookup(const Shard& shard, uint64_t hash, std::string_view input, Language lang) {
+    size_t mask = shard.table.size() - 1;
+    for (size_t i = hash & mask; shard.table[i].entry; i = (i + 1) & mask) {
+      const Slot& slot = shard.table[i];
+      if (slot.hash == hash && slot.entry->lang == lang && slot.entry->Input() == input) {
+        return i;
+      }
+    }
+    return kNotFound;
+  }
+
+  static void Place(Shard& shard, uint64_t hash, Entry* entry) {
+    size_t mask = shard.table.size() - 1;
+    size_t i = hash & mask;
+    while (shard.table[i].entry) {
+      i = (i + 1) & mask;
+    }
+    shard.table[i] = Slot{ hash, entry };
+  }
+
+  static void Rehash(Shard& shard, size_t size) {
+    std::vector<Slot> old(size);
+    old.swap(shard.table);
+    for (const Slot& slot : old) {
+      if (slot.entry) {
+        Place(shard, slot.hash, slot.entry);
+      }
+    }
+  }
+
+  // Empty slot i, and move back the entries after it that would no longer be
+  // found past the hole
+  static void Erase(Shard& shard, size_t i) {
+    size_t mask = shard.table.size() - 1;
+    for (size_t j = (i + 1) & mask; shard.table[j].entry; j = (j + 1) & mask) {
+      size_t home = shard.table[j].hash & mask;
+      bool between = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+      if (!between) {
+        shard.table[i] = shard.table[j];
+        i = j;
+      }
+    }
+    shard.table[i] = Slot();
+  }
+
+  // Move the hand to the first entry not referenced since it last passed,
+  // clearing the bits on the way, and evict it. The last entry takes its slot.
+  void Evict(Shard& shard) {
+    while (true) {
+      if (shard.hand >= shard.clock.size()) {
+        shard.hand = 0;
+      }
+      Entry* entry = shard.clock[shard.hand];
+      if (entry->referenced.exchange(false, std::memory_order_relaxed)) {
+        shard.hand++;
+        continue;
+      }
+      size_t mask = shard.table.size() - 1;
+      size_t i = entry->hash & mask;
+      while (shard.table[i].entry != entry) {
+        i = (i + 1) & mask;
+      }
+      Erase(shard, i);
+      shard.bytes -= entry->Charge();
+      shard.clock[shard.hand] = shard.clock.back();
+      shard.clock[shard.hand]->slot = shard.hand;
+      shard.clock.pop_back();
+      shard.evictions.fetch_add(1, std::memory_order_relaxed);
+      Release(entry);
+      return;
+    }
+  }
+};
+}
+
+#endif
@@ -0,0 +1,239 @@
+// Python binding of the convertor, built as the _chn_num_conv extension
+// module. chn_num_conv.py imports it when it is available and keeps its own
+// parser as a fallback, so the two share one interface:
+//
+//   ChineseNumberConvertor(s, language=Language.Chinese)()
+//   convert_batch(strings, language=Language.Chinese, threads=0)
+//
+// language is a chn_num_conv.Language, or its value as an int.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <new>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "chn_num_conv.h"
+#include "chn_num_conv_batch.h"
+
+namespace {
+
+struct ConvertorObject {
+  PyObject_HEAD
+  std::string                  input;   // the convertor only borrows it
+  sisi::ChineseNumberConvertor cc;
+  PyObject*                    out;     // cached result of the first call
+};
+
+// Accept a Language, whose value is 0 or 1, or the value itself
+bool ParseLanguage(PyObject* obj, sisi::Language* lang) {
+  if (obj == nullptr || obj == Py_None) {
+    *lang = sisi::Language::Chinese;
+    return true;
+  }
+  PyObject* value = obj;
+  if (PyObject_HasAttrString(obj, "value")) {
+    value = PyObject_GetAttrString(obj, "value");
+    if (value == nullptr) {
+      return false;
+    }
+  } else {
+    Py_INCREF(value);
+  }
+  long v = PyLong_Check(value) ? PyLong_AsLong(value) : -1;
+  Py_DECREF(value);
+  if (v == 0 || v == 1) {
+    *lang = v == 1 ? sisi::Language::Japanese : sisi::Language::Chinese;
+    return true;
+  }
+  if (!PyErr_Occurred()) {
+    PyErr_SetString(PyExc_ValueError, "language must be Language.Chinese or Language.Japanese");
+  }
+  return false;
+}
+
+PyObject* FromUTF8(std::string_view s) {
+  return PyUnicode_DecodeUTF8(s.data(), s.size(), nullptr);
+}
+
+PyObject* ConvertorNew(PyTypeObject* type, PyObject* args, PyObject* kwds) {
+  static const char* kwlist[] = { "s", "language", nullptr };
+  const char* s;
+  Py_ssize_t size;
+  PyObject* lang_obj = nullptr;
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "s#|O", (char**)kwlist, &s, &size, &lang_obj)) {
+    return nullptr;
+  }
+  sisi::Language lang;
+  if (!ParseLanguage(lang_obj, &lang)) {
+    return nullptr;
+  }
+  ConvertorObject* self = (ConvertorObject*)type->tp_alloc(type, 0);
+  if (self == nullptr) {
+    return nullptr;
+  }
+  try {
+    new (&self->input) std::string(s, size);
+  } catch (const std::bad_alloc&) {
+    type->tp_free(self);
+    return PyErr_NoMemory();
+  }
+  try {
+    new (&self->cc) sisi::ChineseNumberConvertor(lang);
+  } catch (const std::bad_alloc&) {
+    self->input.~basic_string();
+    type->tp_free(self);
+    return PyErr_NoMemory();
+  }
+  self->cc.Reset(self->input);
+  self->out = nullptr;
+  return (PyObject*)self;
+}
+
+// The type is a heap type, which each of its objects holds a reference to
+void ConvertorDealloc(ConvertorObject* self) {
+  PyTypeObject* type = Py_TYPE(self);
+  Py_XDECREF(self->out);
+  self->cc.~ChineseNumberConvertor();
+  self->input.~basic_string();
+  type->tp_free((PyObject*)self);
+  Py_DECREF(type);
+}
+
+PyObject* ConvertorCall(ConvertorObject* self, PyObject* args, PyObject* kwds) {
+  if (!PyArg_ParseTuple(args, ":__call__") || (kwds && PyDict_Size(kwds) > 0)) {
+    if (!PyErr_Occurred()) {
+      PyErr_SetString(PyExc_TypeError, "__call__() takes no keyword arguments");
+    }
+    return nullptr;
+  }
+  if (self->out == nullptr) {
+    try {
+      self->out = FromUTF8(self->cc.Evaluate());
+    } catch (const std::bad_alloc&) {
+      return PyErr_NoMemory();
+    }
+    if (self->out == nullptr) {
+      return nullptr;
+    }
+  }
+  Py_INCREF(self->out);
+  return self->out;
+}
+
+PyType_Slot kConvertorSlots[] = {
+  { Py_tp_doc, (void*)"ChineseNumberConvertor(s, language=Language.Chinese)\n"
+                      "Call the convertor to get s with its numerals in Arabic digits." },
+  { Py_tp_new, (void*)ConvertorNew },
+  { Py_tp_dealloc, (void*)ConvertorDealloc },
+  { Py_tp_call, (void*)ConvertorCall },
+  { 0, nullptr },
+};
+
+PyType_Spec kConvertorSpec = {
+  "_chn_num_conv.ChineseNumberConvertor",
+  sizeof(ConvertorObject),
+  0,
+  Py_TPFLAGS_DEFAULT,
+  kConvertorSlots,
+};
+
+// The strings are converted on several threads without the GIL, so they are
+// first pinned in a tuple, which another thread cannot change meanwhile.
+PyObject* ConvertBatch(PyObject*, PyObject* args, PyObject* kwds) {
+  static const char* kwlist[] = { "strings", "language", "threads", nullptr };
+  PyObject* strings;
+  PyObject* lang_obj = nullptr;
+  Py_ssize_t threads = 0;
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|On", (char**)kwlist, &strings, &lang_obj, &threads)) {
+    return nullptr;
+  }
+  sisi::Language lang;
+  if (!ParseLanguage(lang_obj, &lang)) {
+    return nullptr;
+  }
+  if (threads < 0) {
+    PyErr_SetString(PyExc_ValueError, "threads must not be negative");
+    return nullptr;
+  }
+  PyObject* items = PySequence_Tuple(strings);
+  if (items == nullptr) {
+    return nullptr;
+  }
+  Py_ssize_t n = PyTuple_GET_SIZE(items);
+  PyObject* result = nullptr;
+  try {
+    std::vector<std::string_view> in(n);
+    for (Py_ssize_t i = 0; i < n; i++) {
+      Py_ssize_t size;
+      const char* s = PyUnicode_AsUTF8AndSize(PyTuple_GET_ITEM(items, i), &size);
+      if (s == nullptr) {
+        Py_DECREF(items);
+        return nullptr;
+      }
+      in[i] = std::string_view(s, size);
+    }
+
+    sisi::BatchConvertor batch(threads);
+    Py_BEGIN_ALLOW_THREADS
+    batch.Convert(in, lang);
+    Py_END_ALLOW_THREADS
+
+    result = PyList_New(n);
+    for (Py_ssize_t i = 0; result && i < n; i++) {
+      PyObject* out = FromUTF8(batch[i]);
+      if (out == nullptr) {
+        Py_CLEAR(result);
+        break;
+      }
+      PyList_SET_ITEM(result, i, out);
+    }
+  } catch (const std::bad_alloc&) {
+    Py_XDECREF(result);
+    result = PyErr_NoMemory();
+  }
+  Py_DECREF(items);
+  return result;
+}
+
+PyMethodDef kMethods[] = {
+  { "convert_batch", (PyCFunction)(void (*)(void))ConvertBatch, METH_VARARGS | METH_KEYWORDS,
+    "convert_batch(strings, language=Language.Chinese, threads=0)\n"
+    "Convert every string of a sequence, on threads cores (all by default),\n"
+    "and return the results as a list. The GIL is released meanwhile." },
+  { nullptr, nullptr, 0, nullptr },
+};
+
+PyModuleDef kModule = {
+  PyModuleDef_HEAD_INIT,
+  "_chn_num_conv",
+  "C++ implementation of chn_num_conv",
+  -1,
+  kMethods,
+  nullptr,
+  nullptr,
+  nullptr,
+  nullptr,
+};
+
+}
+
+PyMODINIT_FUNC PyInit__chn_num_conv() {
+  PyObject* type = PyType_FromSpec(&kConvertorSpec);
+  if (type == nullptr) {
+    return nullptr;
+  }
+  PyObject* m = PyModule_Create(&kModule);
+  if (m == nullptr) {
+    Py_DECREF(type);
+    return nullptr;
+  }
+  if (PyModule_AddObject(m, "ChineseNumberConvertor", type) < 0) {
+    Py_DECREF(type);
+    Py_DECREF(m);
+    return nullptr;
+  }
+  return m;
+}
@@ -0,0 +1,243 @@
+// Command line convertor for large inputs.
+//
+//   sisi_num_conv_cli [-l zh|ja] [-j threads] [-e rd|fsm] [-v vocab] [-o output] [file...]
+//
+// Files are memory-mapped and cut into shards at line boundaries, the shards are
+// converted in parallel and written in their original order. Without a file, or
+// with "-", the standard input is converted as a stream.
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "chn_num_conv.h"
+#include "chn_num_conv_batch.h"
+
+namespace {
+
+const size_t kShardSize = 4 << 20;
+const size_t kShardsPerRound = 4;    // per thread, converted before writing
+
+struct Options {
+  sisi::Language          lang = sisi::Language::Chinese;
+  sisi::ParserEngine      engine = sisi::ParserEngine::RecursiveDescent;
+  size_t                  threads = 0;
+  const char*             output = nullptr;
+  const char*             vocab_path = nullptr;
+  sisi::Vocabulary        vocab;
+  std::vector<const char*> files;
+};
+
+void Usage(const char* prog) {
+  fprintf(stderr,
+          "usage: %s [-l zh|ja] [-j threads] [-e rd|fsm] [-v vocab] [-o output] [file...]\n"
+          "  -l  language of the numerals, zh (default) or ja\n"
+          "  -j  number of threads, defaults to the number of cores\n"
+          "  -e  parser engine, rd (recursive descent, default) or fsm (state machine)\n"
+          "  -v  file of extra tokens, one \"token meaning\" per line\n"
+          "  -o  output file, defaults to the standard output\n"
+          "Without a file, or with -, the standard input is converted.\n", prog);
+}
+
+bool ParseOptions(int argc, char** argv, Options* opts) {
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    if (arg[0] != '-' || strcmp(arg, "-") == 0) {
+      opts->files.push_back(arg);
+      continue;
+    }
+    if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0 || i + 1 >= argc) {
+      return false;
+    }
+    const char* val = argv[++i];
+    if (strcmp(arg, "-l") == 0) {
+      if (strcmp(val, "zh") == 0) {
+        opts->lang = sisi::Language::Chinese;
+      } else if (strcmp(val, "ja") == 0) {
+        opts->lang = sisi::Language::Japanese;
+      } else {
+        return false;
+      }
+    } else if (strcmp(arg, "-j") == 0) {
+      opts->threads = strtoul(val, nullptr, 10);
+    } else if (strcmp(arg, "-e") == 0) {
+      if (strcmp(val, "rd") == 0) {
+        opts->engine = sisi::ParserEngine::RecursiveDescent;
+      } else if (strcmp(val, "fsm") == 0) {
+        opts->engine = sisi::ParserEngine::StateMachine;
+      } else {
+        return false;
+      }
+    } else if (strcmp(arg, "-v") == 0) {
+      opts->vocab_path = val;
+    } else if (strcmp(arg, "-o") == 0) {
+      opts->output = val;
+    } else {
+      return false;
+    }
+  }
+  if (opts->files.empty()) {
+    opts->files.push_back("-");
+  }
+  return true;
+}
+
+bool LoadVocabulary(const char* path, sisi::Vocabulary* vocab) {
+  FILE* f = fopen(path, "rb");
+  if (f == nullptr) {
+    fprintf(stderr, "error: cannot open %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  std::string config;
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    config.append(buf, n);
+  }
+  fclose(f);
+  if (!vocab->Load(config)) {
+    fprintf(stderr, "error: invalid token in %s\n", path);
+    return false;
+  }
+  return true;
+}
+
+bool WriteAll(int fd, std::string_view data) {
+  while (!data.empty()) {
+    ssize_t n = write(fd, data.data(), data.size());
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data.remove_prefix(n);
+  }
+  return true;
+}
+
+// Cut [data, data + size) into shards of about kShardSize bytes ending with a
+// newline, except for the last one
+void MakeShards(const char* data, size_t size, std::vector<std::string_view>* shards) {
+  size_t begin = 0;
+  while (begin < size) {
+    size_t end = std::min(size, begin + kShardSize);
+    if (end < size) {
+      const void* nl = memchr(data + end, '\n', size - end);
+      end = nl ? (const char*)nl - data + 1 : size;
+    }
+    shards->emplace_back(data + begin, end - begin);
+    begin = end;
+  }
+}
+
+bool ConvertFile(const char* path, int out_fd, sisi::BatchConvertor& batch, const Options& opts) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "error: cannot open %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    fprintf(stderr, "error: cannot stat %s: %s\n", path, strerror(errno));
+    close(fd);
+    return false;
+  }
+  size_t size = st.st_size;
+  if (size == 0) {
+    close(fd);
+    return true;
+  }
+  void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "error: cannot map %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  madvise(data, size, MADV_SEQUENTIAL);
+
+  std::vector<std::string_view> shards;
+  MakeShards((const char*)data, size, &shards);
+  size_t per_round = std::max<size_t>(1, opts.threads) * kShardsPerRound;
+  bool ok = true;
+  for (size_t i = 0; i < shards.size() && ok; i += per_round) {
+    size_t n = std::min(per_round, shards.size() - i);
+    batch.Convert(std::span<const std::string_view>(shards.data() + i, n), opts.lang);
+    ok = WriteAll(out_fd, batch.Arena());
+  }
+  munmap(data, size);
+  if (!ok) {
+    fprintf(stderr, "error: cannot write output: %s\n", strerror(errno));
+  }
+  return ok;
+}
+
+bool ConvertStdin(int out_fd, const Options& opts) {
+  sisi::StreamConvertor sc(opts.lang, opts.engine, opts.vocab_path ? &opts.vocab : nullptr);
+  std::vector<char> buf(1 << 20);
+  while (true) {
+    ssize_t n = read(STDIN_FILENO, buf.data(), buf.size());
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      fprintf(stderr, "error: cannot read standard input: %s\n", strerror(errno));
+      return false;
+    }
+    std::string_view out = n == 0 ? sc.Finish() : sc.Feed(std::string_view(buf.data(), n));
+    if (!WriteAll(out_fd, out)) {
+      fprintf(stderr, "error: cannot write output: %s\n", strerror(errno));
+      return false;
+    }
+    if (n == 0) {
+      return true;
+    }
+  }
+}
+
+}
+
+int main(int argc, char** argv) {
+  Options opts;
+  if (!ParseOptions(argc, argv, &opts)) {
+    Usage(argv[0]);
+    return 2;
+  }
+  if (opts.vocab_path && !LoadVocabulary(opts.vocab_path, &opts.vocab)) {
+    return 1;
+  }
+  if (opts.threads == 0) {
+    opts.threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+  }
+
+  int out_fd = STDOUT_FILENO;
+  if (opts.output) {
+    out_fd = open(opts.output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+      fprintf(stderr, "error: cannot open %s: %s\n", opts.output, strerror(errno));
+      return 1;
+    }
+  }
+
+  sisi::BatchConvertor batch(opts.threads, opts.engine, opts.vocab_path ? &opts.vocab : nullptr);
+  bool ok = true;
+  for (const char* path : opts.files) {
+    ok = strcmp(path, "-") == 0 ? ConvertStdin(out_fd, opts) : ConvertFile(path, out_fd, batch, opts);
+    if (!ok) {
+      break;
+    }
+  }
+  if (opts.output && close(out_fd) != 0) {
+    fprintf(stderr, "error: cannot write %s: %s\n", opts.output, strerror(errno));
+    ok = false;
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,103 @@
+// Implementation of the C interface, see sisi_num_conv.h. Nothing here is
+// static and mutable: the tables of the convertor are built once and then
+// only read, and everything else lives in a config or a context.
+
+#include <new>
+
+#include "sisi_num_conv.h"
+#include "chn_num_conv.h"
+
+struct sisi_config {
+  sisi::Language        lang;
+  sisi::ParserEngine    engine;
+  sisi::UTF8ErrorPolicy utf8_policy;
+};
+
+struct sisi_context {
+  explicit sisi_context(const sisi_config& config)
+    : cc(config.lang, config.engine), utf8_policy(config.utf8_policy) {
+    cc.SetUTF8ErrorPolicy(config.utf8_policy);
+  }
+
+  sisi::ChineseNumberConvertor cc;
+  sisi::UTF8ErrorPolicy        utf8_policy;
+};
+
+int sisi_abi_version(void) {
+  return SISI_ABI_VERSION;
+}
+
+sisi_config* sisi_config_new(sisi_language lang, sisi_engine engine) {
+  if ((lang != SISI_LANG_CHINESE && lang != SISI_LANG_JAPANESE) ||
+      (engine != SISI_ENGINE_RECURSIVE_DESCENT && engine != SISI_ENGINE_STATE_MACHINE)) {
+    return nullptr;
+  }
+  return new (std::nothrow) sisi_config{
+    lang == SISI_LANG_JAPANESE ? sisi::Language::Japanese : sisi::Language::Chinese,
+    engine == SISI_ENGINE_STATE_MACHINE ? sisi::ParserEngine::StateMachine : sisi::ParserEngine::RecursiveDescent,
+    sisi::UTF8ErrorPolicy::PassThrough,
+  };
+}
+
+sisi_status sisi_config_set_utf8_policy(sisi_config* config, sisi_utf8_policy policy) {
+  if (config == nullptr ||
+      (policy != SISI_UTF8_PASS_THROUGH && policy != SISI_UTF8_REPLACE && policy != SISI_UTF8_FAIL)) {
+    return SISI_ERROR_INVALID_ARGUMENT;
+  }
+  config->utf8_policy = policy == SISI_UTF8_REPLACE ? sisi::UTF8ErrorPolicy::Replace :
+                        policy == SISI_UTF8_FAIL ? sisi::UTF8ErrorPolicy::Fail : sisi::UTF8ErrorPolicy::PassThrough;
+  return SISI_OK;
+}
+
+void sisi_config_free(sisi_config* config) {
+  delete config;
+}
+
+sisi_context* sisi_context_new(const sisi_config* config) {
+  if (config == nullptr) {
+    return nullptr;
+  }
+  try {
+    return new sisi_context(*config);
+  } catch (const std::bad_alloc&) {
+    return nullptr;
+  }
+}
+
+void sisi_context_free(sisi_context* ctx) {
+  delete ctx;
+}
+
+sisi_status sisi_convert(sisi_context* ctx, const char* in, size_t in_len,
+                         char* out, size_t out_cap, size_t* out_len) {
+  if (ctx == nullptr || (in == nullptr && in_len > 0) || (out == nullptr && out_cap > 0) || out_len == nullptr) {
+    return SISI_ERROR_INVALID_ARGUMENT;
+  }
+  std::string_view str(in ? in : "", in_len);
+  try {
+    sisi::OutputSink sink(out, out_cap);
+    ctx->cc.Convert(str, sink);
+    const sisi::UTF8Errors& errors = ctx->cc.InvalidUTF8();
+    if (errors.count > 0 && ctx->utf8_policy == sisi::UTF8ErrorPolicy::Fail) {
+      *out_len = 0;
+      return SISI_ERROR_INVALID_UTF8;
+    }
+    if (!sink.truncated()) {
+      *out_len = sink.size();
+      return SISI_OK;
+    }
+    // Convert again into the buffer of the context to tell the size needed
+    *out_len = ctx->cc.Convert(str).size();
+    return SISI_ERROR_TRUNCATED;
+  } catch (const std::bad_alloc&) {
+    return SISI_ERROR_NO_MEMORY;
+  }
+}
+
+size_t sisi_invalid_utf8(const sisi_context* ctx) {
+  return ctx ? ctx->cc.InvalidUTF8().count : 0;
+}
+
+size_t sisi_context_error_offset(const sisi_context* ctx) {
+  return ctx && ctx->cc.InvalidUTF8().count > 0 ? ctx->cc.InvalidUTF8().first_offset : 0;
+}
@@ -0,0 +1,129 @@
+/*
+
+Copyright 2023 Sisi
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ * */
+
+/*
+   C interface of libsisi_num_conv.
+
+   A config holds the options and is never modified once a context is created
+   from it, so any number of threads can share it. A context holds the state of one
+   conversion at a time and is used by one thread at a time, typically one per
+   thread. Contexts share nothing writable, so conversions on different
+   contexts never wait for each other.
+
+     sisi_config* config = sisi_config_new(SISI_LANG_CHINESE, SISI_ENGINE_RECURSIVE_DESCENT);
+     sisi_context* ctx = sisi_context_new(config);   // in each thread
+     size_t len;
+     if (sisi_convert(ctx, in, in_len, buf, sizeof(buf), &len) == SISI_OK) use(buf, len);
+     sisi_context_free(ctx);
+     sisi_config_free(config);                       // after all its contexts
+ */
+
+#ifndef _SISI_NUM_CONV_H_
+#define _SISI_NUM_CONV_H_
+
+#include <stddef.h>
+
+#if defined(_WIN32)
+  #if defined(SISI_BUILDING_LIBRARY)
+    #define SISI_API __declspec(dllexport)
+  #else
+    #define SISI_API __declspec(dllimport)
+  #endif
+#else
+  #define SISI_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Bumped when a function or a type changes in an incompatible way
+#define SISI_ABI_VERSION 1
+
+typedef struct sisi_config sisi_config;
+typedef struct sisi_context sisi_context;
+
+typedef enum sisi_language {
+  SISI_LANG_CHINESE  = 0,
+  SISI_LANG_JAPANESE = 1,
+} sisi_language;
+
+typedef enum sisi_engine {
+  SISI_ENGINE_RECURSIVE_DESCENT = 0,
+  SISI_ENGINE_STATE_MACHINE     = 1,
+} sisi_engine;
+
+typedef enum sisi_status {
+  SISI_OK                     = 0,
+  SISI_ERROR_TRUNCATED        = 1,    // the output buffer is too small
+  SISI_ERROR_INVALID_ARGUMENT = 2,
+  SISI_ERROR_NO_MEMORY        = 3,
+  SISI_ERROR_INVALID_UTF8     = 4,    // the input is not UTF-8, see SISI_UTF8_FAIL
+} sisi_status;
+
+// What sisi_convert() does with bytes that are not valid UTF-8
+typedef enum sisi_utf8_policy {
+  SISI_UTF8_PASS_THROUGH = 0,         // copy them unchanged (default)
+  SISI_UTF8_REPLACE      = 1,         // write U+FFFD for each invalid sequence
+  SISI_UTF8_FAIL         = 2,         // return SISI_ERROR_INVALID_UTF8
+} sisi_utf8_policy;
+
+// SISI_ABI_VERSION of the library, which may be newer than the header
+SISI_API int sisi_abi_version(void);
+
+// Return NULL if lang or engine is unknown, or memory is short
+SISI_API sisi_config* sisi_config_new(sisi_language lang, sisi_engine engine);
+
+// Set the UTF-8 policy of the config, before any context is created from it.
+// Return SISI_ERROR_INVALID_ARGUMENT if config is NULL or policy is unknown.
+SISI_API sisi_status sisi_config_set_utf8_policy(sisi_config* config, sisi_utf8_policy policy);
+
+// The config must not be used by any context anymore
+SISI_API void sisi_config_free(sisi_config* config);
+
+// The config must outlive the context. Return NULL if memory is short.
+SISI_API sisi_context* sisi_context_new(const sisi_config* config);
+
+SISI_API void sisi_context_free(sisi_context* ctx);
+
+// Convert the UTF-8 text [in, in + in_len) into [out, out + out_cap), which
+// is not NUL-terminated, and set *out_len to the length of the output. If
+// the output does not fit, return SISI_ERROR_TRUNCATED and set *out_len to
+// the capacity that is needed. out may be NULL if out_cap is 0. With
+// SISI_UTF8_FAIL, return SISI_ERROR_INVALID_UTF8 and set *out_len to 0 if
+// the input is not UTF-8, see sisi_context_error_offset().
+SISI_API sisi_status sisi_convert(sisi_context* ctx, const char* in, size_t in_len,
+                                  char* out, size_t out_cap, size_t* out_len);
+
+// Number of invalid UTF-8 sequences in the input of the last sisi_convert()
+SISI_API size_t sisi_invalid_utf8(const sisi_context* ctx);
+
+// Byte offset of the first invalid UTF-8 sequence in the input of the last
+// sisi_convert(), or 0 if sisi_invalid_utf8() is 0
+SISI_API size_t sisi_context_error_offset(const sisi_context* ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
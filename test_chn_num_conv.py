@@ -1,3 +1,6 @@
+import sys
+
+import chn_num_conv
 from chn_num_conv import *
 
 if __name__ == '__main__':
@@ -12,11 +15,27 @@ if __name__ == '__main__':
         "刚刚清点了今天的收入，总共九万八千五百二十一点一零元",
         "他一个月的工资是三万两千元"
     ]
-    
+    results = [
+        "小米13Pro16加128G要3999元，比红米K60Pro贵",
+        "中国有1410778724人，2000000000000GDP",
+        "1005995英镑",
+        "《1001夜》只卖35元",
+        "红米12 128GB多少钱？",
+        "他的电话是13812345678",
+        "今天是2023年10月31日",
+        "刚刚清点了今天的收入，总共98521.10元",
+        "他1个月的工资是32000元"
+    ]
+    failed = 0
+
+    print("Implementation:", "C++" if chn_num_conv.NATIVE else "Python")
     print("--- Chinese Test Cases ---")
-    for ch in chars:
+    for ch, expected in zip(chars, results):
         cc = ChineseNumberConvertor(ch, language=Language.Chinese)()
         print(cc)
+        if cc != expected:
+            print(f"  FAILED, expected {expected}")
+            failed += 1
 
     jp_chars = [
         "百一", # 101
@@ -28,8 +47,30 @@ if __name__ == '__main__':
         "今日は百一円を使いました",
         "私の戦闘力は五十三万です" # 530,000
     ]
+    jp_results = [
+        "101",
+        "1001",
+        "120000000",
+        "-100",
+        "-100",
+        "0",
+        "今日は101円を使いました",
+        "私の戦闘力は530000です"
+    ]
 
     print("\n--- Japanese Test Cases ---")
-    for ch in jp_chars:
+    for ch, expected in zip(jp_chars, jp_results):
         cc = ChineseNumberConvertor(ch, language=Language.Japanese)()
         print(f"{ch} -> {cc}")
+        if cc != expected:
+            print(f"  FAILED, expected {expected}")
+            failed += 1
+
+    if convert_batch(chars * 100, language=Language.Chinese) != results * 100:
+        print("convert_batch FAILED")
+        failed += 1
+    if convert_batch(jp_chars, Language.Japanese, threads=2) != jp_results:
+        print("convert_batch FAILED")
+        failed += 1
+
+    sys.exit(1 if failed else 0)
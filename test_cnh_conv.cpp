@@ -3,6 +3,8 @@
 
 #include "gtest.h"
 #include "chn_num_conv.h"
+#include "chn_num_conv_batch.h"
+#include "chn_num_conv_cache.h"
 
 TEST(NumConv, ChineseTest) {
   const char *strs[] = {
@@ -22,21 +24,25 @@ TEST(NumConv, ChineseTest) {
       "给我推荐1个4 5000的手机", // Logic converts One to 1.
   };
   
-  for (int i=0; i<sizeof(strs) / sizeof(const char *); i++) {
-    const char* str = strs[i], *r = results[i];
-    sisi::ChineseNumberConvertor cc(str, sisi::Language::Chinese);
-    const char* result = cc().c_str();
-    printf("[CN] %s -> %s\n", str, result);
-    ASSERT_EQ(strcmp(r, result), 0);
+  for (auto engine: {sisi::ParserEngine::RecursiveDescent, sisi::ParserEngine::StateMachine}) {
+    for (int i=0; i<sizeof(strs) / sizeof(const char *); i++) {
+      const char* str = strs[i], *r = results[i];
+      sisi::ChineseNumberConvertor cc(str, sisi::Language::Chinese, engine);
+      const char* result = cc().c_str();
+      printf("[CN] %s -> %s\n", str, result);
+      ASSERT_EQ(strcmp(r, result), 0);
+    }
   }
 }
 
 TEST(NumConv, JapaneseTest) {
     auto run = [](const char* in, const char* expected) {
-        sisi::ChineseNumberConvertor cc(in, sisi::Language::Japanese);
-        std::string res = cc();
-        printf("[JP] %s -> %s\n", in, res.c_str());
-        ASSERT_EQ(res, expected);
+        for (auto engine: {sisi::ParserEngine::RecursiveDescent, sisi::ParserEngine::StateMachine}) {
+            sisi::ChineseNumberConvertor cc(in, sisi::Language::Japanese, engine);
+            std::string res = cc();
+            printf("[JP] %s -> %s\n", in, res.c_str());
+            ASSERT_EQ(res, expected);
+        }
     };
 
     run("百一", "101");
@@ -56,6 +62,649 @@ TEST(NumConv, JapaneseTest) {
     run("千二十四", "1024");
     run("一千二百三十四", "1234");
     run("平成二十四年", "平成24年");
+    run("負ゼロ", "0");
+    run("マイナス、", "マイナス、");
+    run("マイナスゼロ円", "0円");
+    run("マイナ百ゼ", "マイナ100ゼ");
+}
+
+TEST(NumConv, ReuseTest) {
+  // One long-lived convertor must give the same result as a fresh one per input
+  const char *strs[] = {
+      "截至二零二三年十二月，中国有十四亿一千七十七万八千七百二十四人，GDP超过两万五千五百亿人民币",
+      "负",
+      "今年的增长率为负三十五个百分点，需要负责人研究如何止住负增长趋势",
+      "买这个电脑我花了一万五",
+      "",
+      "pi等于三点一四一五九二六五三五，她的电话是一三五一二三四五六七八。",
+  };
+  sisi::ChineseNumberConvertor reused(sisi::Language::Chinese);
+  for (int round=0; round<2; round++) {
+    for (auto str: strs) {
+      sisi::ChineseNumberConvertor fresh(str, sisi::Language::Chinese);
+      ASSERT_EQ(reused.Convert(str), fresh());
+    }
+  }
+
+  sisi::ChineseNumberConvertor reused_jp(sisi::Language::Japanese);
+  ASSERT_EQ(reused_jp.Convert("マイナス百"), "-100");
+  ASSERT_EQ(reused_jp.Convert("ゼロからの勉強"), "0からの勉強");
+  reused_jp.Reset("一億二千万");
+  ASSERT_EQ(reused_jp(), "120000000");
+}
+
+TEST(NumConv, BatchTest) {
+  const char *strs[] = {
+      "截至二零二三年十二月，中国有十四亿一千七十七万八千七百二十四人",
+      "一億二千万",
+      "二百五加三百六等于六百一。三百零五加四十五等于三百五",
+      "",
+      "マイナス百",
+      "他一个月的工资是三万两千元",
+  };
+  std::vector<std::string_view> in;
+  std::vector<sisi::Language> langs;
+  for (int i=0; i<5000; i++) {
+    int k = i % 6;
+    in.push_back(strs[k]);
+    langs.push_back(k == 1 || k == 4 ? sisi::Language::Japanese : sisi::Language::Chinese);
+  }
+  sisi::BatchConvertor batch(4);
+  for (int round=0; round<2; round++) {
+    batch.Convert(in, langs);
+    ASSERT_EQ(batch.size(), in.size());
+    for (size_t i=0; i<in.size(); i++) {
+      sisi::ChineseNumberConvertor cc(in[i].data(), langs[i]);
+      ASSERT_EQ(batch[i], cc());
+    }
+  }
+  batch.Convert(std::span<const std::string_view>(in.data(), 1), sisi::Language::Chinese);
+  ASSERT_EQ(batch.size(), 1);
+  ASSERT_EQ(batch[0], "截至2023年12月，中国有1410778724人");
+}
+
+TEST(NumConv, StreamTest) {
+  std::string text;
+  for (int i=0; i<300; i++) {
+    text += "截至二零二三年十二月，中国有十四亿一千七十七万八千七百二十四人，GDP超过两万五千五百亿人民币。";
+    text += "pi等于三点一四一五九二六五三五，给我推荐一个四五千的手机，负一千零一";
+    text += "营收1.5亿，１２万人，MP3千首，2千零5年，3万5000元，ver2.0";
+  }
+  std::string text_jp;
+  for (int i=0; i<300; i++) {
+    text_jp += "一億二千三百四十五万六千七百八十九、マイナス百とゼロからの勉強、負二億です";
+  }
+  for (auto lang: {sisi::Language::Chinese, sisi::Language::Japanese}) {
+    const std::string& in = lang == sisi::Language::Chinese ? text : text_jp;
+    sisi::ChineseNumberConvertor cc(in.c_str(), lang);
+    std::string expected = cc();
+    for (auto engine: {sisi::ParserEngine::RecursiveDescent, sisi::ParserEngine::StateMachine}) {
+      sisi::StreamConvertor sc(lang, engine);
+      for (size_t step: {1, 2, 5, 7, 64, 1000}) {
+        // Chunk boundaries fall everywhere: inside UTF-8 chars, numerals and ゼロ/マイナス
+        std::string out;
+        for (size_t i=0; i<in.size(); i+=step) {
+          out += sc.Feed(std::string_view(in).substr(i, step));
+        }
+        out += sc.Finish();
+        ASSERT_EQ(out, expected);
+      }
+    }
+  }
+
+  // A numeral longer than kMaxPending is kept whole until it ends
+  std::string units = "x一";
+  for (int i=0; i<500; i++) {
+    units += "亿";
+  }
+  units += "元，" + units;
+  for (auto engine: {sisi::ParserEngine::RecursiveDescent, sisi::ParserEngine::StateMachine}) {
+    std::string expected = sisi::ChineseNumberConvertor(units.c_str(), sisi::Language::Chinese, engine)();
+    sisi::StreamConvertor sc(sisi::Language::Chinese, engine);
+    for (size_t step: {1, 100, 4096}) {
+      std::string out;
+      for (size_t i=0; i<units.size(); i+=step) {
+        out += sc.Feed(std::string_view(units).substr(i, step));
+      }
+      out += sc.Finish();
+      ASSERT_EQ(out, expected);
+    }
+  }
+}
+
+TEST(NumConv, ExtractTest) {
+  for (auto engine: {sisi::ParserEngine::RecursiveDescent, sisi::ParserEngine::StateMachine}) {
+    std::string str = "pi等于三点一四，负零和负一千零一，电话一三五，负";
+    sisi::ChineseNumberConvertor cc(sisi::Language::Chinese, engine);
+    auto& spans = cc.Extract(str);
+    ASSERT_EQ(spans.size(), 6);
+    ASSERT_EQ(str.substr(spans[0].byte_begin, spans[0].byte_end - spans[0].byte_begin), "三点一四");
+    ASSERT_EQ(spans[0].value, 3);
+    ASSERT_EQ(spans[0].has_decimal, true);
+    ASSERT_EQ(spans[1].value, 0);
+    ASSERT_EQ(spans[1].is_negative, true);
+    ASSERT_EQ(str.substr(spans[2].byte_begin, spans[2].byte_end - spans[2].byte_begin), "负一千零一");
+    ASSERT_EQ(spans[2].value, -1001);
+    ASSERT_EQ(spans[2].kind == sisi::NumeralKind::Number, true);
+    ASSERT_EQ(spans[3].value, 1);
+    ASSERT_EQ(spans[3].kind == sisi::NumeralKind::Digit, true);
+    ASSERT_EQ(spans[4].byte_begin, spans[3].byte_end);
+    ASSERT_EQ(spans[5].value, 5);
+
+    sisi::ChineseNumberConvertor jp(sisi::Language::Japanese, engine);
+    str = "一億二千万円";
+    ASSERT_EQ(jp.Extract(str).size(), 1);
+    ASSERT_EQ(jp.Extract(str)[0].value, 120000000);
+    ASSERT_EQ(jp.Extract(str)[0].byte_end, str.size() - strlen("円"));
+  }
+}
+
+TEST(NumConv, LargeNumberTest) {
+  auto run = [](sisi::Language lang, const char* in, const char* expected) {
+    for (auto engine: {sisi::ParserEngine::RecursiveDescent, sisi::ParserEngine::StateMachine}) {
+      sisi::ChineseNumberConvertor cc(in, lang, engine);
+      ASSERT_EQ(cc(), expected);
+    }
+  };
+  auto cn = sisi::Language::Chinese, jp = sisi::Language::Japanese;
+  run(cn, "两万五千五百亿", "2550000000000");
+  run(cn, "三万亿零五", "3000000000005");
+  run(cn, "三亿亿", "30000000000000000");
+  run(cn, "九千九百九十九亿亿", "99990000000000000000");
+  run(cn, "负一亿亿亿五千五", "-1000000000000000000005500");
+  run(cn, "一亿亿亿亿亿", "10000000000000000000000000000000000000000");
+  run(cn, "一亿三千万两千万", "130002000万");
+  run(cn, "一亿亿零五亿", "10000000500000000");
+  run(cn, "九百二十二亿亿三千三百七十二万零三百六十八亿五千四百七十七万五千八百零七", "9223372036854775807");
+  run(cn, "三兆五", "3000005");
+  run(cn, "一京", "10000000000000000");
+  run(jp, "一兆二千億", "1200000000000");
+  run(jp, "九千九百九十九京九千九百九十九兆", "99999999000000000000");
+  run(jp, "一億二千万", "120000000");
+  // A big unit without a number before it is a word, not a numeral
+  run(jp, "東京に行きます", "東京に行きます");
+  run(jp, "京都大学", "京都大学");
+  run(jp, "兆候がある", "兆候がある");
+  run(jp, "億万長者", "億万長者");
+  // A big unit after a zero or empty section is left as it is
+  run(cn, "壹壹三零亿亿", "1130亿亿");
+  run(cn, "零亿亿仟", "0亿亿仟");
+  run(cn, "一零万万千", "10万万千");
+  run(cn, "一亿万", "100000000万");
+
+  for (auto engine: {sisi::ParserEngine::RecursiveDescent, sisi::ParserEngine::StateMachine}) {
+    sisi::ChineseNumberConvertor cc(cn, engine);
+    auto& spans = cc.Extract("三亿亿和九千九百九十九亿亿和负一亿亿亿");
+    ASSERT_EQ(spans.size(), 3);
+    ASSERT_EQ(spans[0].value, 30000000000000000);
+    ASSERT_EQ(spans[0].is_clamped, false);
+    ASSERT_EQ(spans[1].value, INT64_MAX);
+    ASSERT_EQ(spans[1].is_clamped, true);
+    ASSERT_EQ(spans[2].value, INT64_MIN);
+    ASSERT_EQ(spans[2].is_negative, true);
+    ASSERT_EQ(spans[2].is_clamped, true);
+  }
+}
+
+TEST(NumConv, SinkTest) {
+  const char* str = "截至二零二三年十二月，中国有十四亿一千七十七万八千七百二十四人，GDP超过两万五千五百亿人民币";
+  sisi::ChineseNumberConvertor cc(sisi::Language::Chinese);
+  std::string expected = cc.Convert(str);
+
+  char buf[256];
+  sisi::OutputSink fixed(buf, sizeof(buf));
+  cc.Convert(str, fixed);
+  ASSERT_EQ(std::string(buf, fixed.size()), expected);
+  ASSERT_EQ(fixed.truncated(), false);
+
+  sisi::OutputSink small(buf, 10);
+  cc.Convert(str, small);
+  ASSERT_EQ(std::string(buf, small.size()), expected.substr(0, 10));
+  ASSERT_EQ(small.truncated(), true);
+
+  std::string grown = "> ";
+  {
+    sisi::OutputSink sink(&grown);
+    cc.Convert(str, sink);
+    cc.Convert("一亿亿亿亿亿", sink);
+  }
+  ASSERT_EQ(grown, "> " + expected + "10000000000000000000000000000000000000000");
+
+  std::string written;
+  int calls = 0;
+  {
+    sisi::OutputSink sink([&](std::string_view s) { written += s; calls++; });
+    for (int i=0; i<100; i++) {
+      cc.Convert(str, sink);
+    }
+  }
+  ASSERT_EQ(written.size(), expected.size() * 100);
+  ASSERT_EQ(written.substr(written.size() - expected.size()), expected);
+  ASSERT_EQ(calls, 100);
+}
+
+TEST(NumConv, StatsTest) {
+  const char* str = "负责人说一万五千零三十是负的，abc";
+  for (auto engine: {sisi::ParserEngine::RecursiveDescent, sisi::ParserEngine::StateMachine}) {
+    sisi::ChineseNumberConvertor cc(sisi::Language::Chinese, engine);
+    const std::string& out = cc.Convert(str);
+    const sisi::ConversionStats& stats = cc.Stats();
+#if SISI_ENABLE_STATS
+    ASSERT_EQ(stats.numerals, 1);
+    ASSERT_EQ(stats.parse_errors, 2);
+    ASSERT_EQ(stats.output_bytes, out.size());
+    ASSERT_EQ(stats.codepoints + stats.skipped_bytes > 0, true);
+    ASSERT_EQ(stats.restores, engine == sisi::ParserEngine::RecursiveDescent ? 2 : 0);
+    ASSERT_EQ(cc.Extract(str).size(), 1);
+    ASSERT_EQ(cc.Stats().numerals, 1);
+    ASSERT_EQ(cc.Stats().output_bytes, 0);
+    // The state machine never steps back, even over a section with decimals
+    // that the unit after it cannot take
+    cc.Convert("1.5亿，3亿5万1.5亿，三百五十万");
+    ASSERT_EQ(cc.Stats().retracts > 0, engine == sisi::ParserEngine::RecursiveDescent);
+#else
+    ASSERT_EQ(out.empty(), false);
+    ASSERT_EQ(stats.numerals, 0);
+    ASSERT_EQ(stats.output_bytes, 0);
+#endif
+  }
+
+  sisi::StatsHistogram hist;
+  for (uint64_t v : {0, 1, 2, 3, 100, 1000}) {
+    sisi::ConversionStats stats = {};
+    stats.elapsed_ns = v;
+    hist.Add(stats);
+  }
+  sisi::StatsHistogram total;
+  total.Merge(hist);
+  total.Merge(hist);
+  ASSERT_EQ(total.Conversions(), 12);
+  ASSERT_EQ(total.Sum(sisi::StatsHistogram::kElapsedNs), 2212);
+  ASSERT_EQ(total.Count(sisi::StatsHistogram::kElapsedNs, 2), 4);
+  ASSERT_EQ(total.Count(sisi::StatsHistogram::kNumerals, 0), 12);
+  ASSERT_EQ(total.Quantile(sisi::StatsHistogram::kElapsedNs, 0.5), 3);
+  ASSERT_EQ(total.Quantile(sisi::StatsHistogram::kElapsedNs, 1.0), 1023);
+
+  std::vector<std::string_view> lines(1000, str);
+  sisi::BatchConvertor batch(4);
+  sisi::StatsHistogram batch_hist;
+  batch.SetStats(&batch_hist);
+  batch.Convert(lines, sisi::Language::Chinese);
+  ASSERT_EQ(batch_hist.Conversions(), SISI_ENABLE_STATS ? 1000 : 0);
+  ASSERT_EQ(batch_hist.Sum(sisi::StatsHistogram::kNumerals), SISI_ENABLE_STATS ? 1000 : 0);
+}
+
+TEST(NumConv, IncrementalTest) {
+  sisi::IncrementalConvertor ic;
+  ic.Assign("他买了三个，花了五元");
+  ASSERT_EQ(ic.Output(), "他买了3个，花了5元");
+  auto edit = ic.Edit(12, 12, "千");
+  ASSERT_EQ(ic.Text(), "他买了三千个，花了五元");
+  ASSERT_EQ(ic.Output(), "他买了3000个，花了5元");
+  ASSERT_EQ(ic.Output().substr(edit.begin, edit.new_end - edit.begin), "3000");
+  ASSERT_EQ(edit.old_end - edit.begin, 1);
+  ic.Edit(12, 15, "");
+  ASSERT_EQ(ic.Output(), "他买了3个，花了5元");
+
+  // Random edits, checked against converting the whole text
+  const char* pieces[] = { "一", "二", "十", "百", "千", "万", "亿", "零", "负", "点", "两", "五",
+                           "个", "，", "a", " ", "负责", "三千五百", "ゼロ", "マイナス", "兆", "億", "負",
+                           "3", "12", "５", ".", "．" };
+  uint32_t seed = 12345;
+  auto rand = [&](uint32_t n) {
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) % n;
+  };
+  auto random_text = [&](int n) {
+    std::string s;
+    for (int i=0; i<n; i++) {
+      s += pieces[rand(sizeof(pieces) / sizeof(pieces[0]))];
+    }
+    return s;
+  };
+  auto char_start = [](const std::string& s, size_t pos) {
+    while (pos > 0 && pos < s.size() && ((uint8_t)s[pos] & 0xc0) == 0x80) {
+      pos--;
+    }
+    return pos;
+  };
+  for (auto lang: {sisi::Language::Chinese, sisi::Language::Japanese}) {
+    for (auto engine: {sisi::ParserEngine::RecursiveDescent, sisi::ParserEngine::StateMachine}) {
+      sisi::IncrementalConvertor inc(lang, engine);
+      sisi::ChineseNumberConvertor full(lang, engine);
+      inc.Assign(random_text(400));
+      for (int i=0; i<500; i++) {
+        std::string text = inc.Text();
+        std::string old_out = inc.Output();
+        size_t begin = char_start(text, rand(text.size() + 1));
+        size_t end = char_start(text, std::min(text.size(), begin + rand(12)));
+        auto edit = inc.Edit(begin, end, random_text(rand(3)));
+        ASSERT_EQ(inc.Output(), full.Convert(inc.Text()));
+        ASSERT_EQ(old_out.substr(0, edit.begin) + inc.Output().substr(edit.begin, edit.new_end - edit.begin) +
+                  old_out.substr(edit.old_end), inc.Output());
+      }
+    }
+  }
+}
+
+TEST(NumConv, MixedDigitsTest) {
+  auto run = [](sisi::Language lang, const char* in, const char* expected) {
+    for (auto engine: {sisi::ParserEngine::RecursiveDescent, sisi::ParserEngine::StateMachine}) {
+      sisi::ChineseNumberConvertor cc(lang, engine);
+      ASSERT_EQ(cc.Convert(in), expected);
+    }
+  };
+  auto cn = sisi::Language::Chinese, jp = sisi::Language::Japanese;
+  run(cn, "3万，1.5亿，１２万，１．５亿，2千零5", "30000，150000000，120000，150000000，2005");
+  run(cn, "3万5，3万5000，1亿2000万，1.5亿3000万，1.5万亿", "35000，35000，120000000，180000000，1500000000000");
+  run(cn, "一万五，一万5千，十5，1.5千万，负3万人", "15000，15000，15，15000000，-30000人");
+  // Without a unit, or after a letter, digits are left as they are
+  run(cn, "2023年3月，12345，５，2.5，192.168.1.1", "2023年3月，12345，５，2.5，192.168.1.1");
+  run(cn, "MP3千首，v2万，abc1.5亿", "MP3千首，v2万，abc1.5亿");
+  // Decimals the unit does not make whole, sections too long to follow it,
+  // groups of a number and leading zeros
+  run(cn, "1.2345万，1.234万，3万50000", "1.2345万，12340，3万50000");
+  run(cn, "1,000万元，3万05，05万，十2023", "1,000万元，3万05，05万，十2023");
+  run(jp, "3万人、２億５千万円、1.5兆", "30000人、250000000円、1500000000000");
+
+  sisi::ChineseNumberConvertor cc(cn);
+  auto& spans = cc.Extract("约1.5亿人");
+  ASSERT_EQ(spans.size(), 1);
+  ASSERT_EQ(spans[0].value, 150000000);
+  ASSERT_EQ(spans[0].byte_begin, 3);
+  ASSERT_EQ(spans[0].byte_end, 9);
+}
+
+TEST(NumConv, VocabularyTest) {
+  auto cn = sisi::Language::Chinese, jp = sisi::Language::Japanese;
+  sisi::Vocabulary vocab = sisi::Vocabulary::Common();
+  ASSERT_EQ(vocab.Add("两百", "二百"), true);
+  ASSERT_EQ(vocab.Add("x", "一"), false);
+  ASSERT_EQ(vocab.Add("〇", ""), false);
+  ASSERT_EQ(vocab.Load("# more\n拾万 = 十万\n\nゼ ロ 零\n"), false);
+  for (auto engine: {sisi::ParserEngine::RecursiveDescent, sisi::ParserEngine::StateMachine}) {
+    sisi::ChineseNumberConvertor cc(cn, engine, &vocab);
+    ASSERT_EQ(cc.Convert("二〇二三年，电话幺三八"), "2023年，电话138");
+    ASSERT_EQ(cc.Convert("廿三日到卅一日，卅日"), "23日到31日，30日");
+    ASSERT_EQ(cc.Convert("兩萬五千億，負三點五"), "2500000000000，-3.5");
+    ASSERT_EQ(cc.Convert("两百块和拾万元"), "200块和100000元");
+    ASSERT_EQ(cc.Convert("廿世纪"), "20世纪");
+    sisi::ChineseNumberConvertor plain(cn, engine);
+    ASSERT_EQ(plain.Convert("二〇二三年廿三日"), "2〇23年廿3日");
+
+    // 億 is built in for Japanese, where 亿 is not a unit
+    sisi::ChineseNumberConvertor ja(jp, engine, &vocab);
+    ASSERT_EQ(ja.Convert("二億五万、〇、ゼロ"), "200050000、0、0");
+    ASSERT_EQ(ja.Convert("卅"), "30");
+  }
+
+  // Tokens of a stream cut by chunk boundaries
+  sisi::StreamConvertor sc(cn, sisi::ParserEngine::RecursiveDescent, &vocab);
+  std::string out;
+  std::string in = "共两百个，二〇二三年廿三日";
+  for (size_t i = 0; i < in.size(); i++) {
+    out += sc.Feed(in.substr(i, 1));
+  }
+  out += sc.Finish();
+  ASSERT_EQ(out, "共200个，2023年23日");
+
+  sisi::BatchConvertor batch(2, sisi::ParserEngine::RecursiveDescent, &vocab);
+  std::vector<std::string_view> items = { "幺幺〇", "一萬", "卌" };
+  batch.Convert(items, cn);
+  ASSERT_EQ(batch[0], "110");
+  ASSERT_EQ(batch[1], "10000");
+  ASSERT_EQ(batch[2], "40");
+}
+
+TEST(NumConv, WriterTest) {
+  auto cn = sisi::Language::Chinese, jp = sisi::Language::Japanese;
+  auto write = [](sisi::NumeralWriter& writer, int64_t n) {
+    char buf[sisi::NumeralWriter::kMaxSize];
+    auto result = writer.Write(buf, buf + sizeof(buf), n);
+    return std::string(buf, result.ptr);
+  };
+  sisi::NumeralWriter cn_lower(cn), cn_upper(cn, sisi::NumeralStyle::Upper), jp_lower(jp);
+  ASSERT_EQ(write(cn_lower, 1410778724), "十四亿一千零七十七万八千七百二十四");
+  ASSERT_EQ(write(cn_upper, 1410778724), "壹拾肆亿壹仟零柒拾柒万捌仟柒佰贰拾肆");
+  ASSERT_EQ(write(jp_lower, 1410778724), "十四億千七十七万八千七百二十四");
+  ASSERT_EQ(write(cn_lower, 0), "零");
+  ASSERT_EQ(write(cn_lower, -15), "负十五");
+  ASSERT_EQ(write(cn_lower, 100015), "十万零一十五");
+  ASSERT_EQ(write(cn_lower, 10001000), "一千万一千");
+  ASSERT_EQ(write(cn_lower, 100010000), "一亿零一万");
+  ASSERT_EQ(write(cn_lower, 3000000000001), "三万亿零一");
+  ASSERT_EQ(write(jp_lower, 3000000000001), "三兆一");
+  ASSERT_EQ(write(cn_lower, 10000000500000000), "一亿亿零五亿");
+  ASSERT_EQ(write(jp_lower, INT64_MIN), "負九百二十二京三千三百七十二兆三百六十八億五千四百七十七万五千八百八");
+
+  char small[6];
+  auto result = cn_lower.Write(small, small + sizeof(small), 123);
+  ASSERT_EQ(result.ec == std::errc::value_too_large, true);
+  result = cn_lower.Write(small, small + sizeof(small), 20);
+  ASSERT_EQ(std::string(small, result.ptr), "二十");
+
+  ASSERT_EQ(cn_lower.Convert("共1,200.5公里，-3度，2023-10-17，电话010-8888，mp3 1.2.3"),
+            "共一千二百点五公里，负三度，二千零二十三-十-十七，电话零一零-八千八百八十八，mp3 1.2.3");
+
+  // What is written reads back as the same value
+  uint64_t seed = 12345;
+  auto rand = [&]() {
+    seed = seed * 6364136223846793005 + 1442695040888963407;
+    return seed;
+  };
+  for (auto lang: {cn, jp}) {
+    for (auto style: {sisi::NumeralStyle::Lower, sisi::NumeralStyle::Upper}) {
+      sisi::NumeralWriter writer(lang, style);
+      for (auto engine: {sisi::ParserEngine::RecursiveDescent, sisi::ParserEngine::StateMachine}) {
+        sisi::ChineseNumberConvertor cc(lang, engine);
+        for (int i=0; i<5000; i++) {
+          int64_t n = int64_t(rand()) >> (rand() % 64);
+          if (i % 2) {
+            // Mostly zeros, for the rules of 零
+            n = 0;
+            for (int j=0; j<18; j++) {
+              n = n * 10 + (rand() % 4 == 0 ? rand() % 10 : 0);
+            }
+          }
+          ASSERT_EQ(cc.Convert(write(writer, n)), std::to_string(n));
+        }
+      }
+    }
+  }
+}
+
+TEST(NumConv, CacheTest) {
+  sisi::ConversionCache cache(1 << 20, 4);
+  sisi::ChineseNumberConvertor cn, jp(sisi::Language::Japanese);
+  // Cached the second time only
+  ASSERT_EQ(cache.Convert("三百", cn).cached(), false);
+  auto out = cache.Convert("三百", cn);
+  ASSERT_EQ(out.cached(), true);
+  ASSERT_EQ(out.view(), "300");
+  ASSERT_EQ(cache.Convert("三百", cn).view(), "300");
+  ASSERT_EQ(cache.Convert("三百", jp).cached(), false);
+  ASSERT_EQ(cache.Find("三百", sisi::Language::Chinese).view().data(), out.view().data());
+  auto c = cache.GetCounters();
+  ASSERT_EQ(c.hits, 2);
+  ASSERT_EQ(c.misses, 3);
+  ASSERT_EQ(c.entries, 1);
+  ASSERT_EQ(!cache.Find("四百", sisi::Language::Chinese), true);
+  ASSERT_EQ(cache.Insert("四百", sisi::Language::Japanese, "400").view(), "400");
+  ASSERT_EQ(cache.Find("四百", sisi::Language::Japanese).view(), "400");
+
+  // Results outlive the entries evicted under a small budget
+  sisi::ConversionCache small(4 * 1024, 1);
+  std::vector<sisi::ConversionCache::Result> kept;
+  std::vector<std::string> inputs;
+  for (int i=0; i<1000; i++) {
+    inputs.push_back("第" + std::to_string(i) + "个是一千零" + std::to_string(i % 10));
+  }
+  for (auto& input : inputs) {
+    small.Convert(input, cn);
+    kept.push_back(small.Convert(input, cn));
+    ASSERT_EQ(kept.back().cached(), true);
+  }
+  c = small.GetCounters();
+  ASSERT_EQ(c.bytes <= 4 * 1024, true);
+  ASSERT_EQ(c.evictions, c.insertions - c.entries);
+  for (size_t i=0; i<inputs.size(); i++) {
+    ASSERT_EQ(kept[i].view(), sisi::ChineseNumberConvertor(inputs[i].c_str())());
+  }
+
+  // Shared by the workers of a batch
+  std::vector<std::string_view> in;
+  for (int i=0; i<5000; i++) {
+    in.push_back(inputs[i * 7 % 300]);
+  }
+  sisi::BatchConvertor batch(4);
+  batch.SetCache(&cache);
+  for (int round=0; round<2; round++) {
+    batch.Convert(in, sisi::Language::Chinese);
+    for (size_t i=0; i<in.size(); i++) {
+      ASSERT_EQ(batch[i], cn.Convert(in[i]));
+    }
+  }
+  ASSERT_EQ(cache.HitRate() > 0.9, true);
+  cache.Clear();
+  ASSERT_EQ(cache.GetCounters().entries, 0);
+  ASSERT_EQ(out.view(), "300");
+}
+
+TEST(NumConv, UTF8Test) {
+  const std::string bad = "三百\xff二十";
+  sisi::ChineseNumberConvertor cc;
+  ASSERT_EQ(cc.Convert(bad), "300\xff" "20");
+  ASSERT_EQ(cc.InvalidUTF8().count, 1);
+  ASSERT_EQ(cc.InvalidUTF8().first_offset, 6);
+  cc.SetUTF8ErrorPolicy(sisi::UTF8ErrorPolicy::Replace);
+  ASSERT_EQ(cc.Convert(bad), "300\xef\xbf\xbd" "20");
+  // A char cut at the end is one sequence, a stray continuation byte another
+  ASSERT_EQ(cc.Convert("五\x80\x80一千\xe4\xb8"), "5\xef\xbf\xbd\xef\xbf\xbd" "1000\xef\xbf\xbd");
+  ASSERT_EQ(cc.InvalidUTF8().count, 3);
+  // Overlong and surrogate encodings are invalid too
+  ASSERT_EQ(cc.Convert("\xc0\xaf\xed\xa0\x80"), "\xef\xbf\xbd\xef\xbf\xbd\xef\xbf\xbd\xef\xbf\xbd\xef\xbf\xbd");
+  cc.SetUTF8ErrorPolicy(sisi::UTF8ErrorPolicy::Fail);
+  ASSERT_EQ(cc.Convert(bad), "");
+  ASSERT_EQ(cc.InvalidUTF8().first_offset, 6);
+  ASSERT_EQ(cc.Convert("三百"), "300");
+  ASSERT_EQ(cc.InvalidUTF8().count, 0);
+
+  // Random text, valid every other round, checked against decoding it char by char
+  const char* pieces[] = { "一", "百", "a", "12", "𠀀", "abcdefghijklmnopqrstuvwxyz0123456789",
+                           "\xff", "\x80", "\xc2", "\xe4\xb8", "\xf0\x9f\x98", "\xc0\x80", "\xed\xa0\x80", "\xf4\x90\x80\x80" };
+  uint32_t seed = 12345;
+  auto rand = [&](uint32_t n) {
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) % n;
+  };
+  for (int round=0; round<2000; round++) {
+    std::string text;
+    for (int i=rand(40); i>0; i--) {
+      text += pieces[rand(sizeof(pieces) / sizeof(pieces[0]) - (round % 2 ? 8 : 0))];
+    }
+    size_t valid = 0, bad_size;
+    while (valid < text.size()) {
+      size_t n = sisi::UTF8Validator::CharSize((const uint8_t*)text.data() + valid, text.size() - valid, &bad_size);
+      if (n == 0) {
+        break;
+      }
+      valid += n;
+    }
+    size_t prefix = sisi::UTF8Validator::ValidPrefix(text.data(), text.size());
+    ASSERT_EQ(prefix <= valid && (prefix == text.size()) == (valid == text.size()), true);
+    ASSERT_EQ(sisi::UTF8Validator::IsValid(text), valid == text.size());
+  }
+}
+
+TEST(NumConv, LexiconTest) {
+  sisi::PhraseLexicon lexicon = sisi::PhraseLexicon::Idioms();
+  ASSERT_EQ(lexicon.Load("# counties\n统[一]\n  [三]亚 \n"), true);
+  ASSERT_EQ(lexicon.Load("[一\n一]二[\n"), false);
+  const char* texts[] = { "他三心二意地买了三个", "乱七八糟的七八个", "统一了三个省，一统一", "独一无二的二十", "去三亚" };
+  const char* results[] = { "他三心二意地买了3个", "乱七八糟的78个", "统一了3个省，1统一", "独一无二的20", "去三亚" };
+  for (auto engine: {sisi::ParserEngine::RecursiveDescent, sisi::ParserEngine::StateMachine}) {
+    sisi::ChineseNumberConvertor cc(sisi::Language::Chinese, engine);
+    cc.SetLexicon(&lexicon);
+    for (size_t i=0; i<sizeof(texts) / sizeof(texts[0]); i++) {
+      ASSERT_EQ(cc.Convert(texts[i]), results[i]);
+    }
+    ASSERT_EQ(cc.Extract("一石二鸟，三只鸟").size(), 1);
+    cc.SetLexicon(nullptr);
+    ASSERT_EQ(cc.Convert("一石二鸟"), "1石2鸟");
+  }
+
+  // The same lexicon mapped from a file
+  const char* path = "test_cnh_conv_lexicon.bin";
+  ASSERT_EQ(lexicon.Save(path), true);
+  sisi::PhraseLexicon mapped;
+  ASSERT_EQ(mapped.Map(path), true);
+  std::remove(path);
+  sisi::BatchConvertor batch(2);
+  batch.SetLexicon(&mapped);
+  std::vector<std::string_view> in(texts, texts + sizeof(texts) / sizeof(texts[0]));
+  batch.Convert(in, sisi::Language::Chinese);
+  for (size_t i=0; i<in.size(); i++) {
+    ASSERT_EQ(batch[i], results[i]);
+  }
+  // Entries loaded after Map() are merged with the mapped ones
+  ASSERT_EQ(mapped.Load("五湖四海\n"), true);
+  sisi::ChineseNumberConvertor merged;
+  merged.SetLexicon(&mapped);
+  ASSERT_EQ(merged.Convert("五湖四海，去三亚，乱七八糟的七八个"), "五湖四海，去三亚，乱七八糟的78个");
+  ASSERT_EQ(mapped.Map("test_cnh_conv.cpp"), false);
+  ASSERT_EQ(mapped.empty(), true);
+
+  // Random phrases, checked against trying every entry
+  const char* pieces[] = { "一", "二", "石", "鸟", "a", "心" };
+  uint32_t seed = 12345;
+  auto rand = [&](uint32_t n) {
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) % n;
+  };
+  auto random_text = [&](int n) {
+    std::string s;
+    for (int i=0; i<n; i++) {
+      s += pieces[rand(sizeof(pieces) / sizeof(pieces[0]))];
+    }
+    return s;
+  };
+  std::vector<std::string> left, phrase, right;
+  std::string config;
+  for (int i=0; i<300; i++) {
+    left.push_back(rand(2) ? "" : random_text(1));
+    phrase.push_back(random_text(1 + rand(4)));
+    right.push_back(rand(2) ? "" : random_text(1));
+    config += left.back() + "[" + phrase.back() + "]" + right.back() + "\n";
+  }
+  sisi::PhraseLexicon random;
+  ASSERT_EQ(random.Load(config), true);
+  for (int round=0; round<200; round++) {
+    std::string text = random_text(12);
+    for (size_t pos=0; pos<=text.size(); pos++) {
+      size_t end = pos;
+      for (size_t i=0; i<phrase.size(); i++) {
+        std::string_view t(text);
+        if (t.substr(pos).starts_with(phrase[i]) && t.substr(0, pos).ends_with(left[i]) &&
+            t.substr(pos + phrase[i].size()).starts_with(right[i])) {
+          end = std::max(end, pos + phrase[i].size());
+        }
+      }
+      ASSERT_EQ(random.Match(text, pos), end);
+    }
+  }
+
+  // Mapped and loaded again, the random entries are all kept
+  ASSERT_EQ(random.Save(path), true);
+  sisi::PhraseLexicon reloaded;
+  ASSERT_EQ(reloaded.Map(path), true);
+  std::remove(path);
+  ASSERT_EQ(reloaded.Load(""), true);
+  for (int round=0; round<200; round++) {
+    std::string text = random_text(12);
+    for (size_t pos=0; pos<=text.size(); pos++) {
+      ASSERT_EQ(reloaded.Match(text, pos), random.Match(text, pos));
+    }
+  }
 }
 
 int main() {
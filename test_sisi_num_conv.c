@@ -0,0 +1,93 @@
+// Tests of the C interface, which also checks that sisi_num_conv.h is valid C
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sisi_num_conv.h"
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      fprintf(stderr, "Check failed at %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+      exit(1); \
+    } \
+  } while (0)
+
+static const char* kInput = "截至二零二三年十二月，中国有十四亿一千七十七万八千七百二十四人";
+static const char* kOutput = "截至2023年12月，中国有1410778724人";
+
+static void* Worker(void* arg) {
+  sisi_context* ctx = sisi_context_new((const sisi_config*)arg);
+  CHECK(ctx != NULL);
+  char buf[256];
+  for (int i = 0; i < 10000; i++) {
+    size_t len = 0;
+    CHECK(sisi_convert(ctx, kInput, strlen(kInput), buf, sizeof(buf), &len) == SISI_OK);
+    CHECK(len == strlen(kOutput) && memcmp(buf, kOutput, len) == 0);
+  }
+  sisi_context_free(ctx);
+  return NULL;
+}
+
+int main(void) {
+  CHECK(sisi_abi_version() == SISI_ABI_VERSION);
+  CHECK(sisi_config_new((sisi_language)7, SISI_ENGINE_RECURSIVE_DESCENT) == NULL);
+
+  sisi_config* config = sisi_config_new(SISI_LANG_CHINESE, SISI_ENGINE_RECURSIVE_DESCENT);
+  CHECK(config != NULL);
+  sisi_context* ctx = sisi_context_new(config);
+  CHECK(ctx != NULL);
+
+  char buf[16];
+  size_t len = 0;
+  CHECK(sisi_convert(ctx, "", 0, NULL, 0, &len) == SISI_OK && len == 0);
+  CHECK(sisi_convert(ctx, kInput, strlen(kInput), buf, sizeof(buf), &len) == SISI_ERROR_TRUNCATED);
+  CHECK(len == strlen(kOutput));
+  CHECK(sisi_convert(ctx, kInput, strlen(kInput), NULL, 0, &len) == SISI_ERROR_TRUNCATED);
+  CHECK(len == strlen(kOutput));
+  CHECK(sisi_convert(ctx, "三百", strlen("三百"), buf, sizeof(buf), &len) == SISI_OK);
+  CHECK(len == 3 && memcmp(buf, "300", 3) == 0);
+  CHECK(sisi_convert(ctx, NULL, 1, buf, sizeof(buf), &len) == SISI_ERROR_INVALID_ARGUMENT);
+  sisi_context_free(ctx);
+
+  // Many contexts sharing a config
+  pthread_t threads[8];
+  for (int i = 0; i < 8; i++) {
+    CHECK(pthread_create(&threads[i], NULL, Worker, config) == 0);
+  }
+  for (int i = 0; i < 8; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  sisi_config_free(config);
+
+  sisi_config* ja = sisi_config_new(SISI_LANG_JAPANESE, SISI_ENGINE_STATE_MACHINE);
+  ctx = sisi_context_new(ja);
+  const char* in = "マイナス百円";
+  CHECK(sisi_convert(ctx, in, strlen(in), buf, sizeof(buf), &len) == SISI_OK);
+  CHECK(len == strlen("-100円") && memcmp(buf, "-100円", len) == 0);
+  sisi_context_free(ctx);
+  sisi_config_free(ja);
+
+  const char* bad = "三百\xff二十";
+  sisi_config* strict = sisi_config_new(SISI_LANG_CHINESE, SISI_ENGINE_RECURSIVE_DESCENT);
+  CHECK(sisi_config_set_utf8_policy(strict, (sisi_utf8_policy)7) == SISI_ERROR_INVALID_ARGUMENT);
+  CHECK(sisi_config_set_utf8_policy(strict, SISI_UTF8_FAIL) == SISI_OK);
+  ctx = sisi_context_new(strict);
+  CHECK(sisi_convert(ctx, bad, strlen(bad), buf, sizeof(buf), &len) == SISI_ERROR_INVALID_UTF8);
+  CHECK(len == 0 && sisi_invalid_utf8(ctx) == 1 && sisi_context_error_offset(ctx) == 6);
+  CHECK(sisi_convert(ctx, "三百", strlen("三百"), buf, sizeof(buf), &len) == SISI_OK);
+  CHECK(len == 3 && sisi_invalid_utf8(ctx) == 0 && sisi_context_error_offset(ctx) == 0);
+  sisi_context_free(ctx);
+  CHECK(sisi_config_set_utf8_policy(strict, SISI_UTF8_REPLACE) == SISI_OK);
+  ctx = sisi_context_new(strict);
+  CHECK(sisi_convert(ctx, bad, strlen(bad), buf, sizeof(buf), &len) == SISI_OK);
+  const char* replaced = "300\xef\xbf\xbd" "20";
+  CHECK(len == strlen(replaced) && memcmp(buf, replaced, len) == 0);
+  CHECK(sisi_invalid_utf8(ctx) == 1);
+  sisi_context_free(ctx);
+  sisi_config_free(strict);
+
+  printf("All tests passed!\n");
+  return 0;
+}